@@ -3,6 +3,14 @@
 
 #include <linux/of.h>
 
+/*
+ * Users which only build changesets from init code can define this as
+ * __init before including this file, so that the helpers get freed too.
+ */
+#ifndef __of_changeset_helper
+#define __of_changeset_helper
+#endif
+
 /* HACK to not build these against my sunxi-wip tree */
 #ifndef OF_HAVE_CHANGESET_HELPERS
 
@@ -21,7 +29,8 @@ struct kobj_type of_node_ktype = { };
 /**
  * __of_add_property - Add a property to a node without lock operations
  */
-static int __of_add_property(struct device_node *np, struct property *prop)
+static int __of_changeset_helper
+__of_add_property(struct device_node *np, struct property *prop)
 {
 	struct property **next;
 
@@ -50,7 +59,8 @@ static int __of_add_property(struct device_node *np, struct property *prop)
  * dynamically allocated properties and not.
  * Returns the newly allocated property or NULL on out of memory error.
  */
-static struct property *__of_prop_dup(const struct property *prop, gfp_t allocflags)
+static struct property * __of_changeset_helper
+__of_prop_dup(const struct property *prop, gfp_t allocflags)
 {
 	struct property *new;
 
@@ -93,7 +103,8 @@ static struct property *__of_prop_dup(const struct property *prop, gfp_t allocfl
  * OF_DETACHED bits set. Returns the newly allocated node or NULL on out of
  * memory error.
  */
-static struct device_node *__of_node_dupv(const struct device_node *np,
+static struct device_node * __of_changeset_helper
+__of_node_dupv(const struct device_node *np,
 		const char *fmt, va_list vargs)
 {
 	struct device_node *node;
@@ -147,9 +158,9 @@ static struct device_node *__of_node_dupv(const struct device_node *np,
  *
  * Returns a device node on success, an error encoded pointer otherwise
  */
-static inline struct device_node *of_changeset_create_device_nodev(
-	struct of_changeset *ocs, struct device_node *parent,
-	const char *fmt, va_list vargs)
+static inline struct device_node * __of_changeset_helper
+of_changeset_create_device_nodev(struct of_changeset *ocs,
+		struct device_node *parent, const char *fmt, va_list vargs)
 {
 	struct device_node *node;
 
@@ -173,9 +184,9 @@ static inline struct device_node *of_changeset_create_device_nodev(
  *
  * Returns a device node on success, an error encoded pointer otherwise
  */
-static struct device_node *of_changeset_create_device_node(
-	struct of_changeset *ocs, struct device_node *parent,
-	const char *fmt, ...)
+static struct device_node * __of_changeset_helper
+of_changeset_create_device_node(struct of_changeset *ocs,
+		struct device_node *parent, const char *fmt, ...)
 {
 	va_list vargs;
 	struct device_node *node;
@@ -186,7 +197,8 @@ static struct device_node *of_changeset_create_device_node(
 	return node;
 }
 
-static int __of_changeset_add_update_property_copy(struct of_changeset *ocs,
+static int __of_changeset_helper
+__of_changeset_add_update_property_copy(struct of_changeset *ocs,
 		struct device_node *np, const char *name, const void *value,
 		int length, bool update)
 {
@@ -229,7 +241,8 @@ out:
 	return ret;
 }
 
-static int __of_changeset_add_update_property_string(struct of_changeset *ocs,
+static int __of_changeset_helper
+__of_changeset_add_update_property_string(struct of_changeset *ocs,
 		struct device_node *np, const char *name, const char *str,
 		bool update)
 {
@@ -237,7 +250,8 @@ static int __of_changeset_add_update_property_string(struct of_changeset *ocs,
 			strlen(str) + 1, update);
 }
 
-static int __of_changeset_add_update_property_stringv(struct of_changeset *ocs,
+static int __of_changeset_helper
+__of_changeset_add_update_property_stringv(struct of_changeset *ocs,
 		struct device_node *np, const char *name,
 		const char *fmt, va_list vargs, bool update)
 {
@@ -255,8 +269,9 @@ static int __of_changeset_add_update_property_stringv(struct of_changeset *ocs,
 	return ret;
 }
 
-static int __of_changeset_add_update_property_string_list(
-		struct of_changeset *ocs, struct device_node *np, const char *name,
+static int __of_changeset_helper
+__of_changeset_add_update_property_string_list(struct of_changeset *ocs,
+		struct device_node *np, const char *name,
 		const char **strs, int count, bool update)
 {
 	int total = 0, i, ret;
@@ -301,7 +316,8 @@ static int __of_changeset_add_update_property_string_list(
  *
  * Returns zero on success, a negative error value otherwise.
  */
-static inline int of_changeset_add_property_copy(struct of_changeset *ocs,
+static inline int __of_changeset_helper
+of_changeset_add_property_copy(struct of_changeset *ocs,
 		struct device_node *np, const char *name, const void *value,
 		int length)
 {
@@ -322,7 +338,8 @@ static inline int of_changeset_add_property_copy(struct of_changeset *ocs,
  *
  * Returns zero on success, a negative error value otherwise.
  */
-static inline int of_changeset_add_property_string(struct of_changeset *ocs,
+static inline int __of_changeset_helper
+of_changeset_add_property_string(struct of_changeset *ocs,
 		struct device_node *np, const char *name, const char *str)
 {
 	return __of_changeset_add_update_property_string(ocs, np, name, str,
@@ -343,7 +360,8 @@ static inline int of_changeset_add_property_string(struct of_changeset *ocs,
  *
  * Returns zero on success, a negative error value otherwise.
  */
-static inline int of_changeset_add_property_stringf(struct of_changeset *ocs,
+static inline int __of_changeset_helper
+of_changeset_add_property_stringf(struct of_changeset *ocs,
 		struct device_node *np, const char *name, const char *fmt, ...)
 {
 	va_list vargs;
@@ -369,7 +387,8 @@ static inline int of_changeset_add_property_stringf(struct of_changeset *ocs,
  *
  * Returns zero on success, a negative error value otherwise.
  */
-static inline int of_changeset_add_property_string_list(struct of_changeset *ocs,
+static inline int __of_changeset_helper
+of_changeset_add_property_string_list(struct of_changeset *ocs,
 		struct device_node *np, const char *name, const char **strs,
 		int count)
 {
@@ -389,7 +408,8 @@ static inline int of_changeset_add_property_string_list(struct of_changeset *ocs
  *
  * Returns zero on success, a negative error value otherwise.
  */
-static inline int of_changeset_add_property_u32(struct of_changeset *ocs,
+static inline int __of_changeset_helper
+of_changeset_add_property_u32(struct of_changeset *ocs,
 		struct device_node *np, const char *name, u32 val)
 {
 	__be32 _val = cpu_to_be32(val);
@@ -410,7 +430,8 @@ static inline int of_changeset_add_property_u32(struct of_changeset *ocs,
  *
  * Returns zero on success, a negative error value otherwise.
  */
-static inline int of_changeset_add_property_bool(struct of_changeset *ocs,
+static inline int __of_changeset_helper
+of_changeset_add_property_bool(struct of_changeset *ocs,
 		struct device_node *np, const char *name)
 {
 	return __of_changeset_add_update_property_copy(ocs, np, name, "", 0,
@@ -431,7 +452,8 @@ static inline int of_changeset_add_property_bool(struct of_changeset *ocs,
  *
  * Returns zero on success, a negative error value otherwise.
  */
-static inline int of_changeset_update_property_copy(struct of_changeset *ocs,
+static inline int __of_changeset_helper
+of_changeset_update_property_copy(struct of_changeset *ocs,
 		struct device_node *np, const char *name, const void *value,
 		int length)
 {
@@ -452,7 +474,8 @@ static inline int of_changeset_update_property_copy(struct of_changeset *ocs,
  *
  * Returns zero on success, a negative error value otherwise.
  */
-static inline int of_changeset_update_property_string(struct of_changeset *ocs,
+static inline int __of_changeset_helper
+of_changeset_update_property_string(struct of_changeset *ocs,
 		struct device_node *np, const char *name, const char *str)
 {
 	return __of_changeset_add_update_property_string(ocs, np, name, str,
@@ -473,7 +496,8 @@ static inline int of_changeset_update_property_string(struct of_changeset *ocs,
  *
  * Returns zero on success, a negative error value otherwise.
  */
-static inline int of_changeset_update_property_stringf(struct of_changeset *ocs,
+static inline int __of_changeset_helper
+of_changeset_update_property_stringf(struct of_changeset *ocs,
 		struct device_node *np, const char *name, const char *fmt, ...)
 {
 	va_list vargs;
@@ -499,7 +523,8 @@ static inline int of_changeset_update_property_stringf(struct of_changeset *ocs,
  *
  * Returns zero on success, a negative error value otherwise.
  */
-static inline int of_changeset_update_property_string_list(struct of_changeset *ocs,
+static inline int __of_changeset_helper
+of_changeset_update_property_string_list(struct of_changeset *ocs,
 		struct device_node *np, const char *name, const char **strs,
 		int count)
 {
@@ -519,7 +544,8 @@ static inline int of_changeset_update_property_string_list(struct of_changeset *
  *
  * Returns zero on success, a negative error value otherwise.
  */
-static inline int of_changeset_update_property_u32(struct of_changeset *ocs,
+static inline int __of_changeset_helper
+of_changeset_update_property_u32(struct of_changeset *ocs,
 		struct device_node *np, const char *name, u32 val)
 {
 	__be32 _val = cpu_to_be32(val);
@@ -540,7 +566,8 @@ static inline int of_changeset_update_property_u32(struct of_changeset *ocs,
  *
  * Returns zero on success, a negative error value otherwise.
  */
-static inline int of_changeset_update_property_bool(struct of_changeset *ocs,
+static inline int __of_changeset_helper
+of_changeset_update_property_bool(struct of_changeset *ocs,
 		struct device_node *np, const char *name)
 {
 	return __of_changeset_add_update_property_copy(ocs, np, name, "", 0,
@@ -15,19 +15,52 @@
  */
 
 #include <asm/unaligned.h>
+#include <linux/bitmap.h>
+#include <linux/completion.h>
+#include <linux/debugfs.h>
 #include <linux/delay.h>
 #include <linux/err.h>
+#include <linux/firmware.h>
 #include <linux/gpio/consumer.h>
 #include <linux/i2c.h>
+#include <linux/iio/iio.h>
+#include <linux/input.h>
 #include <linux/module.h>
 #include <linux/of_platform.h>
 #include <linux/platform_device.h>
+#include <linux/random.h>
 #include <linux/regulator/consumer.h>
 #include <linux/regulator/driver.h> /* For constaints hack */
 #include <linux/regulator/machine.h> /* For constaints hack */
+#include <linux/sched.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/version.h>
+#include <linux/workqueue.h>
+
+/*
+ * When built with Q8_HWMGR_ONESHOT=1 detection runs exactly once, from
+ * module init, and everything only needed for detection (the chip probe
+ * functions, candidate and heuristics tables and the changeset helpers)
+ * lives in init sections which get freed afterwards. Only the applied
+ * changesets, the profile / timings reporting and remove() stay resident.
+ * This drops rescan, live touchscreen param changes and lazy_accelerometer.
+ */
+#ifdef Q8_HWMGR_ONESHOT
+#define __q8_detect		__init
+#define __q8_detectconst	__initconst
+#define __q8_detectdata		__initdata
+#define Q8_HWMGR_TS_PARAM_PERM	0444 /* Changes could not be applied */
+#else
+#define __q8_detect
+#define __q8_detectconst
+#define __q8_detectdata
+#define Q8_HWMGR_TS_PARAM_PERM	0644
+#endif
+
+#define __of_changeset_helper	__q8_detect
 #include "of-changeset-helpers.h"
+#include "q8-hardwaremgr.h"
 
 /*
  * We can detect which touchscreen controller is used automatically,
@@ -36,41 +69,149 @@
  *
  * We allow the user to specify a firmware_variant to select a config
  * from a list of known configs. We also allow overriding each setting
- * individually.
+ * individually. The settings can be changed at runtime through sysfs,
+ * this re-applies the touchscreen configuration and rebinds the driver.
  */
 
+static void q8_hardwaremgr_touchscreen_param_changed(void);
+
+static int q8_hardwaremgr_ts_param_set_int(const char *val,
+					   const struct kernel_param *kp)
+{
+	int ret;
+
+	ret = param_set_int(val, kp);
+	if (ret == 0)
+		q8_hardwaremgr_touchscreen_param_changed();
+
+	return ret;
+}
+
+static const struct kernel_param_ops q8_hardwaremgr_ts_int_ops = {
+	.set = q8_hardwaremgr_ts_param_set_int,
+	.get = param_get_int,
+};
+
+static int q8_hardwaremgr_ts_param_set_charp(const char *val,
+					     const struct kernel_param *kp)
+{
+	int ret = 0;
+
+	/* An empty name switches back to the automatic firmware name */
+	if (!*val || !strcmp(val, "\n")) {
+		param_free_charp(kp->arg);
+		*(char **)kp->arg = NULL;
+	} else {
+		ret = param_set_charp(val, kp);
+	}
+	if (ret == 0)
+		q8_hardwaremgr_touchscreen_param_changed();
+
+	return ret;
+}
+
+static const struct kernel_param_ops q8_hardwaremgr_ts_charp_ops = {
+	.set = q8_hardwaremgr_ts_param_set_charp,
+	.get = param_get_charp,
+	.free = param_free_charp,
+};
+
 static int touchscreen_variant = -1;
-module_param(touchscreen_variant, int, 0444);
+module_param_cb(touchscreen_variant, &q8_hardwaremgr_ts_int_ops,
+		&touchscreen_variant, Q8_HWMGR_TS_PARAM_PERM);
 MODULE_PARM_DESC(touchscreen_variant, "Touchscreen variant 0-x, -1 for auto");
 
 static int touchscreen_width = -1;
-module_param(touchscreen_width, int, 0444);
+module_param_cb(touchscreen_width, &q8_hardwaremgr_ts_int_ops,
+		&touchscreen_width, Q8_HWMGR_TS_PARAM_PERM);
 MODULE_PARM_DESC(touchscreen_width, "Touchscreen width, -1 for auto");
 
 static int touchscreen_height = -1;
-module_param(touchscreen_height, int, 0444);
+module_param_cb(touchscreen_height, &q8_hardwaremgr_ts_int_ops,
+		&touchscreen_height, Q8_HWMGR_TS_PARAM_PERM);
 MODULE_PARM_DESC(touchscreen_height, "Touchscreen height, -1 for auto");
 
 static int touchscreen_invert_x = -1;
-module_param(touchscreen_invert_x, int, 0444);
+module_param_cb(touchscreen_invert_x, &q8_hardwaremgr_ts_int_ops,
+		&touchscreen_invert_x, Q8_HWMGR_TS_PARAM_PERM);
 MODULE_PARM_DESC(touchscreen_invert_x, "Touchscreen invert x, -1 for auto");
 
 static int touchscreen_invert_y = -1;
-module_param(touchscreen_invert_y, int, 0444);
+module_param_cb(touchscreen_invert_y, &q8_hardwaremgr_ts_int_ops,
+		&touchscreen_invert_y, Q8_HWMGR_TS_PARAM_PERM);
 MODULE_PARM_DESC(touchscreen_invert_y, "Touchscreen invert y, -1 for auto");
 
 static int touchscreen_swap_x_y = -1;
-module_param(touchscreen_swap_x_y, int, 0444);
+module_param_cb(touchscreen_swap_x_y, &q8_hardwaremgr_ts_int_ops,
+		&touchscreen_swap_x_y, Q8_HWMGR_TS_PARAM_PERM);
 MODULE_PARM_DESC(touchscreen_swap_x_y, "Touchscreen swap x y, -1 for auto");
 
 static char *touchscreen_fw_name;
-module_param(touchscreen_fw_name, charp, 0444);
+module_param_cb(touchscreen_fw_name, &q8_hardwaremgr_ts_charp_ops,
+		&touchscreen_fw_name, Q8_HWMGR_TS_PARAM_PERM);
 MODULE_PARM_DESC(touchscreen_fw_name, "Touchscreen firmware filename");
 
+/*
+ * On a 115200 baud serial console every printk line costs milliseconds of
+ * boot time. With compact_log the per-step messages become dev_dbg (they
+ * can be re-enabled through dynamic debug) and a single summary line gets
+ * logged once the detection result has been applied.
+ */
+static bool compact_log;
+module_param(compact_log, bool, 0644);
+MODULE_PARM_DESC(compact_log, "Log a single summary line instead of per-step messages");
+
+#define q8_hardwaremgr_log(func, dev, fmt, ...)			\
+	do {								\
+		if (compact_log)					\
+			dev_dbg(dev, fmt, ##__VA_ARGS__);		\
+		else							\
+			func(dev, fmt, ##__VA_ARGS__);			\
+	} while (0)
+
 enum soc {
-	a13,
-	a23,
-	a33,
+	a13 = Q8_HWMGR_SOC_A13,
+	a23 = Q8_HWMGR_SOC_A23,
+	a33 = Q8_HWMGR_SOC_A33,
+};
+
+/*
+ * Per SoC builds (make Q8_SOC=a13|a23|a33) support only a single SoC. The
+ * soc then is a compile time constant, so that the compiler drops the
+ * other SoCs' template fixups and heuristics, and rows of the tables which
+ * only apply to other SoCs are left out.
+ */
+#if defined(Q8_HWMGR_SOC_ONLY_A13)
+#define Q8_HWMGR_SOC_ONLY	a13
+#define Q8_HWMGR_BUILD_A13	1
+#define Q8_HWMGR_BUILD_A23	0
+#define Q8_HWMGR_BUILD_A33	0
+#elif defined(Q8_HWMGR_SOC_ONLY_A23)
+#define Q8_HWMGR_SOC_ONLY	a23
+#define Q8_HWMGR_BUILD_A13	0
+#define Q8_HWMGR_BUILD_A23	1
+#define Q8_HWMGR_BUILD_A33	0
+#elif defined(Q8_HWMGR_SOC_ONLY_A33)
+#define Q8_HWMGR_SOC_ONLY	a33
+#define Q8_HWMGR_BUILD_A13	0
+#define Q8_HWMGR_BUILD_A23	0
+#define Q8_HWMGR_BUILD_A33	1
+#else
+#define Q8_HWMGR_BUILD_A13	1
+#define Q8_HWMGR_BUILD_A23	1
+#define Q8_HWMGR_BUILD_A33	1
+#endif
+
+#ifdef Q8_HWMGR_SOC_ONLY
+#define q8_hardwaremgr_soc(data)	Q8_HWMGR_SOC_ONLY
+#else
+#define q8_hardwaremgr_soc(data)	((data)->soc)
+#endif
+
+static const char * const soc_names[] = {
+	[a13] = "a13",
+	[a23] = "a23",
+	[a33] = "a33",
 };
 
 #define TOUCHSCREEN_POWER_ON_DELAY	20
@@ -87,6 +228,20 @@ enum {
 	zet6251,
 };
 
+static const char * const touchscreen_model_names[] = {
+	[gsl1680_a082]	= "gsl1680-a082",
+	[gsl1680_b482]	= "gsl1680-b482",
+	[ektf2127]	= "ektf2127",
+	[zet6251]	= "zet6251",
+};
+
+static const char * const touchscreen_compatibles[] = {
+	[gsl1680_a082]	= "silead,gsl1680",
+	[gsl1680_b482]	= "silead,gsl1680",
+	[ektf2127]	= "elan,ektf2127",
+	[zet6251]	= "zeitec,zet6251",
+};
+
 #define DA280_REG_CHIP_ID		0x01
 #define DA280_REG_ACC_Z_LSB		0x06
 #define DA280_REG_MODE_BW		0x11
@@ -95,13 +250,17 @@ enum {
 #define DA280_MODE_DISABLE		0x9e
 
 #define DA311_REG_CHIP_ID		0x0f
+#define DA311_REG_OUT_X_L		0x28
+#define DA311_REG_CHIP_ID_ALIAS		0x4f /* Register map wraps at 0x40 */
 #define DA311_CHIP_ID			0x13
 
 #define DMARD06_CHIP_ID_REG		0x0f
+#define DMARD06_XOUT_REG		0x41
 #define DMARD05_CHIP_ID			0x05
 #define DMARD06_CHIP_ID			0x06
 #define DMARD07_CHIP_ID			0x07
 #define DMARD09_REG_CHIPID		0x18
+#define DMARD09_REG_X			0x0c
 #define DMARD09_CHIPID			0x95
 #define DMARD10_REG_STADR		0x12
 #define DMARD10_REG_STAINT		0x1c
@@ -116,9 +275,33 @@ enum {
 #define MC3210_PRODUCT_CODE		0x90
 #define MC3230_PRODUCT_CODE		0x19
 
+#define MXC6225_REG_XOUT		0x00
 #define MXC6225_REG_CHIP_ID		0x08
 #define MXC6225_CHIP_ID			0x05
 
+#define MMA7660_REG_XOUT		0x00 /* XOUT, YOUT, ZOUT, bit 7 is 0 */
+#define ZET6251_VALID_PACKET		0x3c
+
+/*
+ * Identification confidence. A match on a protocol handshake or on several
+ * registers is high confidence. A single id register, which some other
+ * chip may happen to have the same value in, is graded by
+ * q8_hardwaremgr_read_id(): medium if the id reads back the same and the
+ * chip decodes register addresses, stable if the id reads back the same
+ * but the data register happened to read as the id too, low otherwise.
+ * Matches below min_confidence are reported but not applied, a wrong
+ * compatible costs a failing downstream driver probe, which is much more
+ * expensive than a few extra reads.
+ */
+#define Q8_CONFIDENCE_HIGH		90
+#define Q8_CONFIDENCE_MEDIUM		70
+#define Q8_CONFIDENCE_STABLE		60
+#define Q8_CONFIDENCE_LOW		30
+
+static int min_confidence = 50;
+module_param(min_confidence, int, 0644);
+MODULE_PARM_DESC(min_confidence, "Minimum identification confidence (0-100) for applying a detected chip");
+
 enum {
 	accel_unknown,
 	da226,
@@ -135,15 +318,80 @@ enum {
 	mxc6225,
 };
 
+static const char * const accelerometer_model_names[] = {
+	[da226]		= "da226",
+	[da280]		= "da280",
+	[da311]		= "da311",
+	[dmard05]	= "dmard05",
+	[dmard06]	= "dmard06",
+	[dmard07]	= "dmard07",
+	[dmard09]	= "dmard09",
+	[dmard10]	= "dmard10",
+	[mc3210]	= "mc3210",
+	[mc3230]	= "mc3230",
+	[mma7660]	= "mma7660",
+	[mxc6225]	= "mxc6225",
+};
+
+static const char * const accelerometer_compatibles[] = {
+	[da226]		= "miramems,da226",
+	[da280]		= "miramems,da280",
+	[da311]		= "miramems,da311",
+	[dmard05]	= "domintech,dmard05",
+	[dmard06]	= "domintech,dmard06",
+	[dmard07]	= "domintech,dmard07",
+	[dmard09]	= "domintech,dmard09",
+	[dmard10]	= "domintech,dmard10",
+	[mc3210]	= "mcube,mc3210",
+	[mc3230]	= "mcube,mc3230",
+	[mma7660]	= "fsl,mma7660",
+	[mxc6225]	= "memsic,mxc6225",
+};
+
+static const char *q8_hardwaremgr_model_name(const char * const *names,
+					     int count, int model)
+{
+	if (model < 0 || model >= count || !names[model])
+		return "none";
+
+	return names[model];
+}
+
+enum {
+	timing_start,
+	timing_probe,
+	timing_detected,
+	timing_applied,
+	timing_touchscreen_bound,
+	timing_touchscreen_registered,
+	timing_accelerometer_bound,
+	timing_accelerometer_registered,
+	timing_count,
+};
+
 struct q8_hardwaremgr_device {
 	int model;
 	int addr;
+	int confidence;
+	/* Best match which was not applied because of its confidence */
+	int rejected_model;
+	int rejected_addr;
+	int rejected_confidence;
 	const char *compatible;
+	/* Bus the chip was found on by discovery, NULL for the template's */
+	struct device_node *bus_np;
 	bool delete_regulator;
+	bool needs_regulator;
+	struct of_changeset cset;
+	bool applied;
 };
 
+struct q8_hardwaremgr_ts_rule;
+
 struct q8_hardwaremgr_data {
 	struct device *dev;
+	struct mutex lock; /* Protects detection and the applied changesets */
+	struct mutex of_node_lock; /* Protects patching dev->of_node */
 	enum soc soc;
 	struct q8_hardwaremgr_device touchscreen;
 	struct q8_hardwaremgr_device accelerometer;
@@ -154,7 +402,43 @@ struct q8_hardwaremgr_data {
 	int touchscreen_invert_y;
 	int touchscreen_swap_x_y;
 	const char *touchscreen_fw_name;
+	char *user_fw_name; /* Our copy of the touchscreen_fw_name param */
+	const struct q8_hardwaremgr_ts_rule *touchscreen_rule;
+	struct work_struct touchscreen_work;
+	struct delayed_work accelerometer_work;
+	int accelerometer_retries;
 	bool has_rda599x;
+	unsigned int quirks;
+	struct of_changeset quirks_cset;
+	bool quirks_applied;
+	/* Downstream driver tracking, the nodes are protected by timing_lock */
+	struct device_node *touchscreen_np;
+	struct device_node *accelerometer_np;
+	struct notifier_block i2c_nb;
+#if IS_REACHABLE(CONFIG_IIO)
+	struct notifier_block iio_nb;
+#endif
+	struct input_handler input_handler;
+	spinlock_t timing_lock;
+	u64 timing[timing_count];
+	bool timing_reported;
+	/* Touchscreen firmware prefetch */
+	struct mutex fw_lock;
+	struct work_struct fw_work;
+	char *fw_path; /* The name the touchscreen driver requests */
+	const struct firmware *touchscreen_fw;
+	bool fw_requested;
+	bool touchscreen_bound;
+	bool powered; /* Power-on delay already waited for */
+	/* Shadow mode */
+	bool legacy_engine;
+	struct q8_hardwaremgr_data *shadow;
+	u64 engine_ns[2][2]; /* [legacy][accelerometer] */
+	char shadow_report[256];
+	/* Private hit counters of scratch data, NULL to use the module params */
+	unsigned int *touchscreen_hits;
+	unsigned int *accelerometer_hits;
+	bool read_only; /* Discovery, skip candidates which write */
 };
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 10, 0)
@@ -183,11 +467,86 @@ typedef int (*bus_probe_func)(struct q8_hardwaremgr_data *data,
 typedef int (*client_probe_func)(struct q8_hardwaremgr_data *data,
 				 struct i2c_client *client);
 
-static struct device_node *q8_hardware_mgr_apply_common(
+/*
+ * The changesets describing the detected hardware are kept around after
+ * applying them, so that they can be reverted on remove and on rescan.
+ */
+static int __q8_detect q8_hardwaremgr_commit_cset(
+	struct q8_hardwaremgr_data *data, struct of_changeset *cset,
+	bool *applied)
+{
+	int ret;
+
+	ret = of_changeset_apply(cset);
+	if (ret) {
+		dev_err(data->dev, "Error applying changeset %d\n", ret);
+		of_changeset_destroy(cset);
+		return ret;
+	}
+
+	*applied = true;
+	return 0;
+}
+
+static void q8_hardwaremgr_revert_cset(struct q8_hardwaremgr_data *data,
+				       struct of_changeset *cset, bool *applied)
+{
+	int ret;
+
+	if (!*applied)
+		return;
+
+	ret = of_changeset_revert(cset);
+	if (ret)
+		dev_err(data->dev, "Error reverting changeset %d\n", ret);
+
+	of_changeset_destroy(cset);
+	*applied = false;
+}
+
+/*
+ * Discovery found the chip on another bus than the template node's, create
+ * a copy of the template below that bus as part of the changeset, so that
+ * reverting the changeset also removes the copy again.
+ */
+static struct device_node * __q8_detect q8_hardwaremgr_reparent(
 	struct q8_hardwaremgr_device *dev, struct of_changeset *cset,
-	const char *prefix)
+	struct device_node *template, const char *prefix)
 {
 	struct device_node *np;
+	struct property *prop;
+
+	np = of_changeset_create_device_node(cset, dev->bus_np, "%s@%x",
+					     prefix, dev->addr);
+	if (IS_ERR(np))
+		return NULL;
+
+	of_changeset_add_property_string(cset, np, "name", prefix);
+
+	for_each_property_of_node(template, prop) {
+		if (!strcmp(prop->name, "name") ||
+		    !strcmp(prop->name, "phandle") ||
+		    !strcmp(prop->name, "linux,phandle") ||
+		    !strcmp(prop->name, "status") ||
+		    (dev->delete_regulator &&
+		     !strcmp(prop->name, "vddio-supply")))
+			continue;
+
+		of_changeset_add_property_copy(cset, np, prop->name,
+					       prop->value, prop->length);
+	}
+
+	of_changeset_attach_node(cset, np);
+
+	/* Our caller drops the template's reference, hand it one for np */
+	return of_node_get(np);
+}
+
+static struct device_node * __q8_detect q8_hardware_mgr_apply_common(
+	struct q8_hardwaremgr_device *dev, struct of_changeset *cset,
+	const char *prefix)
+{
+	struct device_node *np, *template;
 
 	np = of_find_node_by_name(of_root, prefix);
 	/* Never happens already checked in q8_hardwaremgr_do_probe() */
@@ -195,12 +554,24 @@ static struct device_node *q8_hardware_mgr_apply_common(
 		return NULL;
 
 	of_changeset_init(cset);
+
+	if (dev->bus_np) {
+		template = np;
+		np = q8_hardwaremgr_reparent(dev, cset, template, prefix);
+		of_node_put(template);
+		if (!np) {
+			of_changeset_destroy(cset);
+			return NULL;
+		}
+	}
+
 	of_changeset_add_property_u32(cset, np, "reg", dev->addr);
 	of_changeset_add_property_string(cset, np, "compatible",
 					 dev->compatible);
 	of_changeset_update_property_string(cset, np, "status", "okay");
 
-	if (dev->delete_regulator) {
+	/* The copy of a reparented node already lacks the vddio-supply */
+	if (dev->delete_regulator && !dev->bus_np) {
 		struct property *p;
 
 		p = of_find_property(np, "vddio-supply", NULL);
@@ -214,835 +585,4156 @@ static struct device_node *q8_hardware_mgr_apply_common(
 	return np; /* Allow the caller to make further changes */
 }
 
-static int q8_hardwaremgr_probe_client(struct q8_hardwaremgr_data *data,
-				       struct q8_hardwaremgr_device *dev,
-				       struct i2c_adapter *adap, u16 addr,
-				       client_probe_func client_probe)
+/*
+ * The downstream driver tracking must follow a reparented node. The
+ * notifiers compare against the tracked nodes from other contexts, so
+ * they are swapped under timing_lock.
+ */
+static void __q8_detect q8_hardwaremgr_track_node(
+	struct q8_hardwaremgr_data *data, struct device_node **tracked,
+	struct device_node *np)
 {
-	struct i2c_client *client;
-	int ret;
-
-	client = i2c_new_dummy(adap, addr);
-	if (!client)
-		return -ENOMEM;
+	struct device_node *old;
+	unsigned long flags;
 
-	/* ret will be one of 0: Success, -ETIMEDOUT: Bus stuck or -ENODEV */
-	ret = client_probe(data, client);
-	if (ret == 0)
-		dev->addr = addr;
-
-	i2c_unregister_device(client);
-
-	return ret;
-}
+	if (np == *tracked)
+		return;
 
-#define PROBE_CLIENT(dev, addr, probe) \
-{ \
-	int ret = q8_hardwaremgr_probe_client(data, dev, adap, addr, probe); \
-	if (ret != -ENODEV) \
-		return ret; \
+	of_node_get(np);
+	spin_lock_irqsave(&data->timing_lock, flags);
+	old = *tracked;
+	*tracked = np;
+	spin_unlock_irqrestore(&data->timing_lock, flags);
+	of_node_put(old);
 }
 
-static int q8_hardwaremgr_probe_silead(struct q8_hardwaremgr_data *data,
-				       struct i2c_client *client)
-{
-	__le32 chip_id;
-	int ret;
-
-	ret = i2c_smbus_read_i2c_block_data(client, SILEAD_REG_ID,
-					    sizeof(chip_id), (u8 *)&chip_id);
-	if (ret != sizeof(chip_id))
-		return ret == -ETIMEDOUT ? -ETIMEDOUT : -ENODEV;
+/*
+ * Capture / replay of the probe i2c traffic, to reproduce a field unit's
+ * detection run on another machine. With the capture param set every
+ * transfer and sleep done while probing gets logged to debugfs
+ * q8-hwmgr/capture as a series of little endian records. Writing such a
+ * log to q8-hwmgr/replay runs the bus probe functions against it instead
+ * of against real hardware, see README.md. A NULL adapter means replaying.
+ */
+#define Q8_HARDWAREMGR_CAPTURE_SIZE	16384
+#define Q8_HARDWAREMGR_ADDR_COUNT	128 /* 7 bit i2c addresses */
+
+#define Q8_HWMGR_REC_CONFIG		0 /* flags: prescan, data: hits */
+#define Q8_HWMGR_REC_MSG		1 /* value: transfer return value */
+#define Q8_HWMGR_REC_SLEEP		2 /* value: sleep in ms */
+#define Q8_HWMGR_REC_PROBE		3 /* value: 0 touchscreen, 1 accel */
+#define Q8_HWMGR_REC_DONE		4 /* value: ret, addr/flags: result */
+
+#define Q8_HWMGR_REC_READ		BIT(0)
+#define Q8_HWMGR_REC_LEGACY		BIT(0) /* PROBE: legacy engine */
+#define Q8_HWMGR_REC_POWERED		BIT(1) /* PROBE: powered up front */
+
+struct q8_hardwaremgr_rec {
+	__le32 time_us;	/* Since the start of detection */
+	u8 type;
+	u8 adapter;	/* i2c adapter nr */
+	u8 addr;	/* 7 bit i2c address, or address found for DONE */
+	u8 flags;	/* Q8_HWMGR_REC_READ, or model found for DONE */
+	__le16 len;	/* Length of the data following the record */
+	__le16 value;
+} __packed;
+
+struct q8_hardwaremgr_capture {
+	u8 *buf;
+	size_t len;
+	u64 start_ns;
+	bool active;
+	bool truncated;
+};
 
-	switch (le32_to_cpu(chip_id)) {
-	case 0xa0820000:
-		data->touchscreen.compatible = "silead,gsl1680";
-		data->touchscreen.model = gsl1680_a082;
-		dev_info(data->dev, "Silead touchscreen ID: 0xa0820000\n");
-		return 0;
-	case 0xb4820000:
-		data->touchscreen.compatible = "silead,gsl1680";
-		data->touchscreen.model = gsl1680_b482;
-		dev_info(data->dev, "Silead touchscreen ID: 0xb4820000\n");
-		return 0;
-	default:
-		dev_warn(data->dev, "Silead? touchscreen with unknown ID: 0x%08x\n",
-			 le32_to_cpu(chip_id));
-	}
+static bool capture;
+module_param(capture, bool, 0644);
+MODULE_PARM_DESC(capture, "Record probe i2c transfers in debugfs q8-hwmgr/capture");
+
+static struct q8_hardwaremgr_capture q8_hardwaremgr_capture_log;
+static DEFINE_SPINLOCK(q8_hardwaremgr_capture_lock);
+static struct debugfs_blob_wrapper q8_hardwaremgr_capture_blob;
+static struct dentry *q8_hardwaremgr_debugfs;
+
+struct q8_hardwaremgr_replay {
+	const u8 *buf;
+	size_t len;
+	size_t pos;
+	unsigned int records;
+	unsigned int transfers;
+	unsigned int sleep_ms;
+	bool diverged;
+	bool prescan;
+	unsigned int *touchscreen_hits;
+	unsigned int *accelerometer_hits;
+	/* Fuzzing against a simulated bus instead of a log, see fuzz below */
+	bool fuzz;
+	int pattern;
+	u32 seed;
+	struct rnd_state rnd;
+	DECLARE_BITMAP(present, Q8_HARDWAREMGR_ADDR_COUNT);
+	u8 reg[Q8_HARDWAREMGR_ADDR_COUNT]; /* Last register written */
+	u8 chip[Q8_HARDWAREMGR_ADDR_COUNT]; /* Index into fuzz_chips */
+};
 
-	return -ENODEV;
-}
+enum {
+	q8_fuzz_random,
+	q8_fuzz_zeros,
+	q8_fuzz_ones,
+	q8_fuzz_stable, /* Random, but the same for each read of a register */
+	q8_fuzz_collision, /* Stable, with a random chip's id registers */
+	q8_fuzz_pattern_count,
+};
 
-static int q8_hardwaremgr_probe_ektf2127(struct q8_hardwaremgr_data *data,
-					 struct i2c_client *client)
-{
-	unsigned char buff[4];
-	int ret;
+/*
+ * The id register contents of the supported chips. With the collision
+ * pattern each present address answers as one of these, picked at random,
+ * so that every probe function also gets to see the other chips' ids.
+ */
+struct q8_hardwaremgr_fuzz_chip {
+	bool accelerometer;
+	int model; /* 0 for the rda599x */
+	struct {
+		u8 reg;
+		u8 len;
+		u8 val[4];
+	} regs[2];
+};
 
-	/* Read hello, ignore data, depends on initial power state */
-	ret = i2c_master_recv(client, buff, 4);
-	if (ret != 4)
-		return ret == -ETIMEDOUT ? -ETIMEDOUT : -ENODEV;
+static const struct q8_hardwaremgr_fuzz_chip q8_hardwaremgr_fuzz_chips[] __q8_detectconst = {
+	{ false, gsl1680_a082,
+	  { { SILEAD_REG_ID, 4, { 0x00, 0x00, 0x82, 0xa0 } } } },
+	{ false, gsl1680_b482,
+	  { { SILEAD_REG_ID, 4, { 0x00, 0x00, 0x82, 0xb4 } } } },
+	{ true, da280, { { DA280_REG_CHIP_ID, 1, { DA280_CHIP_ID } } } },
+	{ true, da311, { { DA311_REG_CHIP_ID, 1, { DA311_CHIP_ID } },
+			 { DA311_REG_CHIP_ID_ALIAS, 1, { DA311_CHIP_ID } } } },
+	{ true, dmard05, { { DMARD06_CHIP_ID_REG, 1, { DMARD05_CHIP_ID } } } },
+	{ true, dmard06, { { DMARD06_CHIP_ID_REG, 1, { DMARD06_CHIP_ID } } } },
+	{ true, dmard07, { { DMARD06_CHIP_ID_REG, 1, { DMARD07_CHIP_ID } } } },
+	{ true, dmard09, { { DMARD09_REG_CHIPID, 1, { DMARD09_CHIPID } } } },
+	{ true, dmard10, { { DMARD10_REG_STADR, 1, { DMARD10_VALUE_STADR } },
+			   { DMARD10_REG_STAINT, 1, { DMARD10_VALUE_STAINT } } } },
+	{ true, mc3210, { { MC3230_REG_CHIP_ID, 1, { MC3230_CHIP_ID } },
+			  { MC3230_REG_PRODUCT_CODE, 1, { MC3210_PRODUCT_CODE } } } },
+	{ true, mc3230, { { MC3230_REG_CHIP_ID, 1, { MC3230_CHIP_ID } },
+			  { MC3230_REG_PRODUCT_CODE, 1, { MC3230_PRODUCT_CODE } } } },
+	{ true, mma7660, { { MC3230_REG_CHIP_ID, 1, { MMA7660_CHIP_ID } },
+			   { MC3230_REG_PRODUCT_CODE, 1, { MMA7660_PRODUCT_CODE } } } },
+	{ true, mxc6225, { { MXC6225_REG_CHIP_ID, 1, { MXC6225_CHIP_ID } } } },
+	{ false, 0, { { 0x0c, 2, { 0x58, 0x20 } } } }, /* rda5820 fm */
+};
 
-	/* Request width */
-	buff[0] = EKTF2127_REQUEST;
-	buff[1] = EKTF2127_WIDTH;
-	buff[2] = 0x00;
-	buff[3] = 0x00;
-	ret = i2c_master_send(client, buff, 4);
-	if (ret != 4)
-		return ret == -ETIMEDOUT ? -ETIMEDOUT : -ENODEV;
+/* Protected by q8_hardwaremgr_replay_lock */
+static struct q8_hardwaremgr_replay q8_hardwaremgr_replay_state;
 
-	msleep(20);
+static void __q8_detect q8_hardwaremgr_capture(u8 type,
+	struct i2c_adapter *adap, u8 addr, u8 flags, int value,
+	const void *payload, u16 len)
+{
+	struct q8_hardwaremgr_capture *log = &q8_hardwaremgr_capture_log;
+	struct q8_hardwaremgr_rec rec;
+	unsigned long irqflags;
 
-	/* Read response */
-	ret = i2c_master_recv(client, buff, 4);
-	if (ret != 4)
-		return ret == -ETIMEDOUT ? -ETIMEDOUT : -ENODEV;
+	if (!log->active)
+		return;
 
-	if (buff[0] == EKTF2127_RESPONSE && buff[1] == EKTF2127_WIDTH) {
-		data->touchscreen.compatible = "elan,ektf2127";
-		data->touchscreen.model = ektf2127;
-		return 0;
+	rec.time_us = cpu_to_le32(div_u64(ktime_get_ns() - log->start_ns,
+					  NSEC_PER_USEC));
+	rec.type = type;
+	rec.adapter = adap ? adap->nr : 0;
+	rec.addr = addr;
+	rec.flags = flags;
+	rec.len = cpu_to_le16(len);
+	rec.value = cpu_to_le16(value);
+
+	spin_lock_irqsave(&q8_hardwaremgr_capture_lock, irqflags);
+
+	if (log->len + sizeof(rec) + len > Q8_HARDWAREMGR_CAPTURE_SIZE) {
+		if (!log->truncated)
+			pr_warn("q8-hwmgr: capture log full, dropping records\n");
+		log->truncated = true;
+		goto out;
 	}
 
-	return -ENODEV;
+	memcpy(log->buf + log->len, &rec, sizeof(rec));
+	log->len += sizeof(rec);
+	if (payload)
+		memcpy(log->buf + log->len, payload, len);
+	else
+		memset(log->buf + log->len, 0, len);
+	log->len += len;
+
+	q8_hardwaremgr_capture_blob.size = log->len;
+out:
+	spin_unlock_irqrestore(&q8_hardwaremgr_capture_lock, irqflags);
 }
 
-static int q8_hardwaremgr_probe_zet6251(struct q8_hardwaremgr_data *data,
-					struct i2c_client *client)
+static const struct q8_hardwaremgr_rec * __q8_detect
+q8_hardwaremgr_replay_next(u8 type, const u8 **payload)
 {
-	unsigned char buff[4];
-	int ret;
+	struct q8_hardwaremgr_replay *r = &q8_hardwaremgr_replay_state;
+	const struct q8_hardwaremgr_rec *rec;
+	size_t len;
 
-	/*
-	 * We only do a simple read finger data packet test, because some
-	 * versions require firmware to be loaded. If no firmware is loaded
-	 * the buffer will be filed with 0xff, so we ignore the contents.
-	 */
-	ret = i2c_master_recv(client, buff, 24);
-	if (ret != 24)
-		return ret == -ETIMEDOUT ? -ETIMEDOUT : -ENODEV;
+	if (r->diverged || r->pos + sizeof(*rec) > r->len)
+		goto diverged;
 
-	data->touchscreen.compatible = "zeitec,zet6251";
-	data->touchscreen.model = zet6251;
-	return 0;
-}
+	rec = (const struct q8_hardwaremgr_rec *)(r->buf + r->pos);
+	len = le16_to_cpu(rec->len);
+	if (rec->type != type || r->pos + sizeof(*rec) + len > r->len)
+		goto diverged;
 
-static int q8_hardwaremgr_probe_touchscreen(struct q8_hardwaremgr_data *data,
-					    struct i2c_adapter *adap)
-{
-	msleep(TOUCHSCREEN_POWER_ON_DELAY);
+	if (payload)
+		*payload = (const u8 *)(rec + 1);
 
-	PROBE_CLIENT(&data->touchscreen, 0x40, q8_hardwaremgr_probe_silead);
-	PROBE_CLIENT(&data->touchscreen, 0x15, q8_hardwaremgr_probe_ektf2127);
-	PROBE_CLIENT(&data->touchscreen, 0x76, q8_hardwaremgr_probe_zet6251);
+	r->pos += sizeof(*rec) + len;
+	r->records++;
+	return rec;
 
-	return -ENODEV;
+diverged:
+	r->diverged = true;
+	return NULL;
 }
 
-static void q8_hardwaremgr_apply_gsl1680_a082_variant(
-	struct q8_hardwaremgr_data *data)
+/* Overwrite a collision pattern read with the address' chip's id, if any */
+static void __q8_detect q8_hardwaremgr_fuzz_id(struct q8_hardwaremgr_replay *r,
+					       struct i2c_msg *msg)
 {
-	if (touchscreen_variant != -1) {
-		data->touchscreen_variant = touchscreen_variant;
-	} else {
-		/*
-		 * These accelerometer based heuristics select the best
-		 * default based on known q8 tablets.
-		 */
-		switch (data->accelerometer.model) {
-		case mc3230:
-			data->touchscreen_invert_x = 1;
-			break;
-		case dmard10:
-		case mxc6225:
-			data->touchscreen_variant = 1;
-			break;
+	const struct q8_hardwaremgr_fuzz_chip *chip =
+		&q8_hardwaremgr_fuzz_chips[r->chip[msg->addr]];
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(chip->regs); i++) {
+		if (chip->regs[i].len && chip->regs[i].reg == r->reg[msg->addr]) {
+			memcpy(msg->buf, chip->regs[i].val,
+			       min_t(u16, msg->len, chip->regs[i].len));
+			return;
 		}
 	}
-
-	switch (data->touchscreen_variant) {
-	default:
-		dev_warn(data->dev, "Error unknown touchscreen_variant %d using 0\n",
-			 touchscreen_variant);
-		/* Fall through */
-	case 0:
-		data->touchscreen_width = 1024;
-		data->touchscreen_height = 600;
-		data->touchscreen_fw_name = "gsl1680-a082-q8-700.fw";
-		break;
-	case 1:
-		data->touchscreen_width = 480;
-		data->touchscreen_height = 800;
-		data->touchscreen_swap_x_y = 1;
-		data->touchscreen_fw_name = "gsl1680-a082-q8-a70.fw";
-		break;
-	}
 }
 
-static void q8_hardwaremgr_apply_gsl1680_b482_variant(
-	struct q8_hardwaremgr_data *data)
+static int __q8_detect q8_hardwaremgr_fuzz_transfer(struct i2c_msg *msgs,
+						    int num)
 {
-	if (touchscreen_variant != -1) {
-		data->touchscreen_variant = touchscreen_variant;
-	} else {
-		/*
-		 * These accelerometer based heuristics select the best
-		 * default based on known q8 tablets.
-		 */
-		switch (data->accelerometer.model) {
-		case da280:
-			if (data->accelerometer.addr == 0x27)
-				; /* No-op */
-			else if (data->has_rda599x)
-				data->touchscreen_invert_x = 1;
-			else
-				data->touchscreen_invert_y = 1;
+	struct q8_hardwaremgr_replay *r = &q8_hardwaremgr_replay_state;
+	struct rnd_state st;
+	int i;
+
+	r->transfers++;
+
+	if (!test_bit(msgs[0].addr, r->present))
+		return -ENXIO;
+
+	for (i = 0; i < num; i++) {
+		struct i2c_msg *msg = &msgs[i];
+
+		if (!(msg->flags & I2C_M_RD)) {
+			if (msg->len)
+				r->reg[msg->addr] = msg->buf[0];
+			continue;
+		}
+
+		switch (r->pattern) {
+		case q8_fuzz_random:
+			prandom_bytes_state(&r->rnd, msg->buf, msg->len);
 			break;
-		case dmard09:
-			data->touchscreen_invert_x = 1;
+		case q8_fuzz_zeros:
+			memset(msg->buf, 0x00, msg->len);
 			break;
-		case mxc6225:
-			data->touchscreen_variant = 1;
+		case q8_fuzz_ones:
+			memset(msg->buf, 0xff, msg->len);
+			break;
+		case q8_fuzz_stable:
+		case q8_fuzz_collision:
+			prandom_seed_state(&st, ((u64)r->seed << 16) |
+					   (msg->addr << 8) | r->reg[msg->addr]);
+			prandom_bytes_state(&st, msg->buf, msg->len);
+			if (r->pattern == q8_fuzz_collision)
+				q8_hardwaremgr_fuzz_id(r, msg);
 			break;
 		}
 	}
 
-	switch (data->touchscreen_variant) {
-	default:
-		dev_warn(data->dev, "Error unknown touchscreen_variant %d using 0\n",
-			 touchscreen_variant);
-		/* Fall through */
-	case 0:
-		data->touchscreen_width = 960;
-		data->touchscreen_height = 640;
-		data->touchscreen_fw_name = "gsl1680-b482-q8-d702.fw";
-		break;
-	case 1:
-		data->touchscreen_width = 960;
-		data->touchscreen_height = 640;
-		data->touchscreen_fw_name = "gsl1680-b482-q8-a70.fw";
-		break;
-	}
+	return num;
 }
 
-static void q8_hardwaremgr_issue_gsl1680_warning(
-	struct q8_hardwaremgr_data *data)
+static int __q8_detect q8_hardwaremgr_replay_transfer(struct i2c_msg *msgs,
+						      int num)
 {
-	dev_warn(data->dev, "gsl1680 touchscreen may require kernel cmdline parameters to function properly\n");
-	dev_warn(data->dev, "Try q8_hardwaremgr.touchscreen_invert_x=%d if x coordinates are inverted\n",
-		 !data->touchscreen_invert_x);
-	dev_warn(data->dev, "Try q8_hardwaremgr.touchscreen_variant=%d if coordinates are all over the place\n",
-		 !data->touchscreen_variant);
+	const struct q8_hardwaremgr_rec *rec = NULL;
+	const u8 *payload;
+	int i;
 
-#define	show(x) \
-	dev_info(data->dev, #x " %d (%s)\n", data->x, \
-		 (x == -1) ? "auto" : "user supplied")
+	if (q8_hardwaremgr_replay_state.fuzz)
+		return q8_hardwaremgr_fuzz_transfer(msgs, num);
 
-	show(touchscreen_variant);
-	show(touchscreen_width);
-	show(touchscreen_height);
-	show(touchscreen_invert_x);
-	show(touchscreen_invert_y);
-	show(touchscreen_swap_x_y);
-	dev_info(data->dev, "touchscreen_fw_name %s (%s)\n",
-		 data->touchscreen_fw_name,
-		 (touchscreen_fw_name == NULL) ? "auto" : "user supplied");
-#undef show
-}
+	for (i = 0; i < num; i++) {
+		u8 flags = (msgs[i].flags & I2C_M_RD) ? Q8_HWMGR_REC_READ : 0;
 
-static void q8_hardwaremgr_apply_touchscreen(struct q8_hardwaremgr_data *data)
-{
-	struct of_changeset cset;
-	struct device_node *np;
+		rec = q8_hardwaremgr_replay_next(Q8_HWMGR_REC_MSG, &payload);
+		if (!rec || rec->addr != msgs[i].addr || rec->flags != flags ||
+		    le16_to_cpu(rec->len) != msgs[i].len)
+			goto diverged;
 
-	switch (data->touchscreen.model) {
-	case touchscreen_unknown:
-		return;
-	case gsl1680_a082:
-		q8_hardwaremgr_apply_gsl1680_a082_variant(data);
-		break;
-	case gsl1680_b482:
-		q8_hardwaremgr_apply_gsl1680_b482_variant(data);
-		break;
-	case ektf2127:
-	case zet6251:
-		/* These have only 1 variant */
-		break;
+		if (flags & Q8_HWMGR_REC_READ)
+			memcpy(msgs[i].buf, payload, msgs[i].len);
+		else if (memcmp(msgs[i].buf, payload, msgs[i].len))
+			goto diverged;
 	}
 
-	if (touchscreen_width != -1)
-		data->touchscreen_width = touchscreen_width;
+	q8_hardwaremgr_replay_state.transfers++;
+	return (s16)le16_to_cpu(rec->value);
 
-	if (touchscreen_height != -1)
-		data->touchscreen_height = touchscreen_height;
+diverged:
+	q8_hardwaremgr_replay_state.diverged = true;
+	return -EIO;
+}
 
-	if (touchscreen_invert_x != -1)
-		data->touchscreen_invert_x = touchscreen_invert_x;
+/*
+ * Bus occupancy accounting, to tell whether a slow detection comes from
+ * sleeps, from too many transfers or from a slow bus clock. The time each
+ * transfer occupies the bus gets computed from the bytes transferred and
+ * the adapter's clock-frequency and accumulated per bus. Candidates and
+ * bus passes get the difference of their bus' counters over their run, on
+ * top of their wall-clock time. See debugfs q8-hwmgr/occupancy. The bus
+ * counters are kept in slots claimed by adapter number, transfers on buses
+ * beyond the last slot are only counted as dropped.
+ */
+#define Q8_HARDWAREMGR_MAX_BUSES	16
+
+struct q8_hardwaremgr_bus_stats {
+	u64 wire_ns;	/* Computed bus occupancy */
+	u64 xfer_ns;	/* Wall-clock time spent in transfers */
+	u64 sleep_ns;
+	u64 total_ns;	/* Wall-clock time, candidates and passes only */
+	unsigned int transfers;
+	unsigned int bytes;
+	unsigned int runs;
+	u32 clock_hz;	/* Buses only */
+	int nr;		/* Buses only, adapter number */
+};
 
-	if (touchscreen_invert_y != -1)
-		data->touchscreen_invert_y = touchscreen_invert_y;
+static struct q8_hardwaremgr_bus_stats
+	q8_hardwaremgr_bus_stats[Q8_HARDWAREMGR_MAX_BUSES];
+static int q8_hardwaremgr_bus_count;
+static unsigned int q8_hardwaremgr_bus_dropped;
+static struct q8_hardwaremgr_bus_stats q8_hardwaremgr_pass_stats[2];
+static DEFINE_SPINLOCK(q8_hardwaremgr_stats_lock);
 
-	if (touchscreen_swap_x_y != -1)
-		data->touchscreen_swap_x_y = touchscreen_swap_x_y;
+/* Must be called with q8_hardwaremgr_stats_lock held */
+static struct q8_hardwaremgr_bus_stats * __q8_detect q8_hardwaremgr_bus(
+	struct i2c_adapter *adap)
+{
+	struct q8_hardwaremgr_bus_stats *bus;
+	int i;
 
-	if (touchscreen_fw_name)
-		data->touchscreen_fw_name = touchscreen_fw_name;
+	if (!adap)
+		return NULL;
 
-	if (data->touchscreen.model == gsl1680_a082 ||
-	    data->touchscreen.model == gsl1680_b482)
-		q8_hardwaremgr_issue_gsl1680_warning(data);
-
-	np = q8_hardware_mgr_apply_common(&data->touchscreen, &cset,
-					  "touchscreen");
-	if (!np)
-		return;
+	for (i = 0; i < q8_hardwaremgr_bus_count; i++)
+		if (q8_hardwaremgr_bus_stats[i].nr == adap->nr)
+			return &q8_hardwaremgr_bus_stats[i];
 
-	if (data->touchscreen_width)
-		of_changeset_add_property_u32(&cset, np, "touchscreen-size-x",
-					      data->touchscreen_width);
-	if (data->touchscreen_height)
-		of_changeset_add_property_u32(&cset, np, "touchscreen-size-y",
-					      data->touchscreen_height);
-	if (data->touchscreen_invert_x)
-		of_changeset_add_property_bool(&cset, np,
-					       "touchscreen-inverted-x");
-	if (data->touchscreen_invert_y)
-		of_changeset_add_property_bool(&cset, np,
-					       "touchscreen-inverted-y");
-	if (data->touchscreen_swap_x_y)
-		of_changeset_add_property_bool(&cset, np,
-					       "touchscreen-swapped-x-y");
-	if (data->touchscreen_fw_name)
-		of_changeset_add_property_string(&cset, np, "firmware-name",
-						 data->touchscreen_fw_name);
+	if (q8_hardwaremgr_bus_count == Q8_HARDWAREMGR_MAX_BUSES) {
+		pr_warn_once("q8-hwmgr: too many buses, not accounting i2c-%d\n",
+			     adap->nr);
+		return NULL;
+	}
 
-	of_changeset_apply(&cset);
-	of_changeset_destroy(&cset);
-	of_node_put(np);
+	bus = &q8_hardwaremgr_bus_stats[q8_hardwaremgr_bus_count++];
+	bus->nr = adap->nr;
+	return bus;
 }
 
-static int q8_hardwaremgr_probe_rda599x(struct q8_hardwaremgr_data *data,
-					struct i2c_client *client)
+static void __q8_detect q8_hardwaremgr_stats_begin(
+	struct i2c_adapter *adap, struct q8_hardwaremgr_bus_stats *snap)
 {
-	int id;
+	struct q8_hardwaremgr_bus_stats *bus;
 
-	/*
-	 * Check for the (integrated) rda580x / rda5820 fm receiver at 0x11
-	 *
-	 * Alternatively we could check for the wifi_rf i2c interface at
-	 * address 0x14, by selecting page/bank 1 through:
-	 * smbus_write_word_swapped(0x3f, 0x01)
-	 * and then doing a smbus_read_word_swapped(0x20) which will
-	 * return 0x5990 for a rda5990. We prefer the fm detect method since
-	 * we want to avoid doing any smbus_writes while probing.
-	 */
-	id = i2c_smbus_read_word_swapped(client, 0x0c);
-	if (id == 0x5802 || id == 0x5803 || id == 0x5805 || id == 0x5820)
-		data->has_rda599x = true;
+	memset(snap, 0, sizeof(*snap));
 
-	return id == -ETIMEDOUT ? -ETIMEDOUT : -ENODEV;
+	spin_lock(&q8_hardwaremgr_stats_lock);
+	bus = q8_hardwaremgr_bus(adap);
+	if (bus)
+		*snap = *bus;
+	spin_unlock(&q8_hardwaremgr_stats_lock);
+
+	snap->total_ns = ktime_get_ns();
 }
 
-static int q8_hardwaremgr_probe_mxc6225(struct q8_hardwaremgr_data *data,
-					struct i2c_client *client)
+static void __q8_detect q8_hardwaremgr_stats_end(
+	struct i2c_adapter *adap, struct q8_hardwaremgr_bus_stats *snap,
+	struct q8_hardwaremgr_bus_stats *stats)
 {
-	int id;
-
-	id = i2c_smbus_read_byte_data(client, MXC6225_REG_CHIP_ID);
-	/* Bits 7 - 5 of the chip-id register are undefined */
-	if (id >= 0 && (id & 0x1f) == MXC6225_CHIP_ID) {
-		data->accelerometer.compatible = "memsic,mxc6225";
-		data->accelerometer.model = mxc6225;
-		return 0;
+	struct q8_hardwaremgr_bus_stats *bus;
+	u64 now = ktime_get_ns();
+
+	spin_lock(&q8_hardwaremgr_stats_lock);
+	bus = q8_hardwaremgr_bus(adap);
+	if (bus) {
+		stats->wire_ns += bus->wire_ns - snap->wire_ns;
+		stats->xfer_ns += bus->xfer_ns - snap->xfer_ns;
+		stats->sleep_ns += bus->sleep_ns - snap->sleep_ns;
+		stats->transfers += bus->transfers - snap->transfers;
+		stats->bytes += bus->bytes - snap->bytes;
 	}
-
-	return id == -ETIMEDOUT ? -ETIMEDOUT : -ENODEV;
+	stats->total_ns += now - snap->total_ns;
+	stats->runs++;
+	spin_unlock(&q8_hardwaremgr_stats_lock);
 }
 
-static int q8_hardwaremgr_probe_mc3230(struct q8_hardwaremgr_data *data,
-				       struct i2c_client *client)
+/*
+ * Each message takes a start condition, its address byte and its data
+ * bytes, at 9 clocks per byte including the ack, the transfer ends with a
+ * stop condition. A failed transfer is counted up to the first address
+ * byte, which is where a missing chip NAKs.
+ */
+static void __q8_detect q8_hardwaremgr_account_transfer(
+	struct i2c_adapter *adap, struct i2c_msg *msgs, int num, int ret,
+	u64 ns)
 {
-	int id, pc = 0;
+	struct q8_hardwaremgr_bus_stats *bus;
+	unsigned int i, bytes = 0, clocks;
+	u32 hz;
 
-	/* First check chip-id, then product-id */
-	id = i2c_smbus_read_byte_data(client, MC3230_REG_CHIP_ID);
-	if (id == MC3230_CHIP_ID || id == MMA7660_CHIP_ID) {
-		pc = i2c_smbus_read_byte_data(client, MC3230_REG_PRODUCT_CODE);
-		switch (pc) {
-		case MMA7660_PRODUCT_CODE:
-			data->accelerometer.compatible = "fsl,mma7660";
-			data->accelerometer.model = mma7660;
-			return 0;
-		case MC3210_PRODUCT_CODE:
-			data->accelerometer.compatible = "mcube,mc3210";
-			data->accelerometer.model = mc3210;
-			return 0;
-		case MC3230_PRODUCT_CODE:
-			data->accelerometer.compatible = "mcube,mc3230";
-			data->accelerometer.model = mc3230;
-			return 0;
-		case -ETIMEDOUT:
-			return -ETIMEDOUT; /* Bus stuck bail immediately */
-		}
+	if (!adap)
+		return;
+
+	if (ret == num) {
+		for (i = 0; i < num; i++)
+			bytes += msgs[i].len;
+		clocks = num * 10 + bytes * 9 + 1;
+	} else {
+		clocks = 1 + 9 + 1;
 	}
 
-	return id == -ETIMEDOUT ? -ETIMEDOUT : -ENODEV;
+	if (of_property_read_u32(adap->dev.of_node, "clock-frequency", &hz) ||
+	    !hz)
+		hz = 100000; /* The i2c default */
+
+	spin_lock(&q8_hardwaremgr_stats_lock);
+	bus = q8_hardwaremgr_bus(adap);
+	if (!bus) {
+		q8_hardwaremgr_bus_dropped++;
+		spin_unlock(&q8_hardwaremgr_stats_lock);
+		return;
+	}
+	bus->clock_hz = hz;
+	bus->wire_ns += div_u64((u64)clocks * NSEC_PER_SEC, hz);
+	bus->xfer_ns += ns;
+	bus->transfers++;
+	bus->bytes += bytes;
+	spin_unlock(&q8_hardwaremgr_stats_lock);
 }
 
-static int q8_hardwaremgr_probe_dmard06(struct q8_hardwaremgr_data *data,
-					struct i2c_client *client)
+static void __q8_detect q8_hardwaremgr_account_sleep(struct i2c_adapter *adap,
+						     u64 ns)
 {
-	int id;
+	struct q8_hardwaremgr_bus_stats *bus;
 
-	id = i2c_smbus_read_byte_data(client, DMARD06_CHIP_ID_REG);
-	switch (id) {
-	case DMARD05_CHIP_ID:
-		data->accelerometer.compatible = "domintech,dmard05";
-		data->accelerometer.model = dmard05;
-		return 0;
-	case DMARD06_CHIP_ID:
-		data->accelerometer.compatible = "domintech,dmard06";
-		data->accelerometer.model = dmard06;
-		return 0;
-	case DMARD07_CHIP_ID:
-		data->accelerometer.compatible = "domintech,dmard07";
-		data->accelerometer.model = dmard07;
-		return 0;
-	}
+	if (!adap)
+		return;
 
-	return id == -ETIMEDOUT ? -ETIMEDOUT : -ENODEV;
+	spin_lock(&q8_hardwaremgr_stats_lock);
+	bus = q8_hardwaremgr_bus(adap);
+	if (bus)
+		bus->sleep_ns += ns;
+	spin_unlock(&q8_hardwaremgr_stats_lock);
 }
 
-static int q8_hardwaremgr_probe_dmard09(struct q8_hardwaremgr_data *data,
-					struct i2c_client *client)
+static int __q8_detect q8_hardwaremgr_transfer(struct i2c_adapter *adap,
+					       struct i2c_msg *msgs, int num)
 {
-	int id;
+	u64 start;
+	int i, ret;
 
-	id = i2c_smbus_read_byte_data(client, DMARD09_REG_CHIPID);
-	if (id == DMARD09_CHIPID) {
-		data->accelerometer.compatible = "domintech,dmard09";
-		data->accelerometer.model = dmard09;
-		return 0;
+	if (!adap)
+		return q8_hardwaremgr_replay_transfer(msgs, num);
+
+	start = ktime_get_ns();
+	ret = __i2c_transfer(adap, msgs, num);
+	q8_hardwaremgr_account_transfer(adap, msgs, num, ret,
+					ktime_get_ns() - start);
+
+	for (i = 0; i < num; i++) {
+		bool read = msgs[i].flags & I2C_M_RD;
+
+		q8_hardwaremgr_capture(Q8_HWMGR_REC_MSG, adap, msgs[i].addr,
+				       read ? Q8_HWMGR_REC_READ : 0, ret,
+				       (read && ret != num) ? NULL : msgs[i].buf,
+				       msgs[i].len);
 	}
 
-	return id == -ETIMEDOUT ? -ETIMEDOUT : -ENODEV;
+	return ret;
 }
 
-static int q8_hardwaremgr_probe_dmard10(struct q8_hardwaremgr_data *data,
-					struct i2c_client *client)
+static void __q8_detect q8_hardwaremgr_msleep(struct i2c_adapter *adap,
+					      unsigned int ms)
 {
-	int stadr, staint = 0;
+	const struct q8_hardwaremgr_rec *rec;
+	u64 start;
 
-	/* These 2 registers have special POR reset values used for id */
-	stadr = i2c_smbus_read_byte_data(client, DMARD10_REG_STADR);
-	if (stadr == DMARD10_VALUE_STADR) {
-		staint = i2c_smbus_read_byte_data(client, DMARD10_REG_STAINT);
-		switch (staint) {
-		case DMARD10_VALUE_STAINT:
-			data->accelerometer.compatible = "domintech,dmard10";
-			data->accelerometer.model = dmard10;
-			return 0;
-		case -ETIMEDOUT:
-			return -ETIMEDOUT; /* Bus stuck bail immediately */
+	if (!adap) {
+		if (!q8_hardwaremgr_replay_state.fuzz) {
+			rec = q8_hardwaremgr_replay_next(Q8_HWMGR_REC_SLEEP,
+							 NULL);
+			if (rec && le16_to_cpu(rec->value) != ms)
+				q8_hardwaremgr_replay_state.diverged = true;
 		}
+		q8_hardwaremgr_replay_state.sleep_ms += ms;
+		return;
 	}
 
-	return stadr == -ETIMEDOUT ? -ETIMEDOUT : -ENODEV;
+	start = ktime_get_ns();
+	msleep(ms);
+	q8_hardwaremgr_account_sleep(adap, ktime_get_ns() - start);
+	q8_hardwaremgr_capture(Q8_HWMGR_REC_SLEEP, adap, 0, 0, ms, NULL, 0);
+}
+
+static void __q8_detect q8_hardwaremgr_lock_bus(struct i2c_adapter *adap)
+{
+	if (adap)
+		i2c_lock_bus(adap, I2C_LOCK_SEGMENT);
+}
+
+static void __q8_detect q8_hardwaremgr_unlock_bus(struct i2c_adapter *adap)
+{
+	if (adap)
+		i2c_unlock_bus(adap, I2C_LOCK_SEGMENT);
 }
 
-static int q8_hardwaremgr_probe_da280(struct q8_hardwaremgr_data *data,
-				      struct i2c_client *client)
+/*
+ * The adapter is locked for a whole bus pass, so that other traffic on the
+ * bus (e.g. to the rda599x) can not interleave with multi-transfer probe
+ * sequences. This means that the probe functions must use these unlocked,
+ * __i2c_transfer() based, equivalents of the i2c_smbus_* / i2c_master_*
+ * helpers. Like their counterparts they return the value read, the number
+ * of bytes transferred or 0 for writes, or a negative errno.
+ */
+static int __q8_detect q8_hardwaremgr_xfer(struct i2c_client *client,
+					   struct i2c_msg *msgs, int num)
 {
 	int ret;
 
-	ret = i2c_smbus_read_byte_data(client, DA280_REG_CHIP_ID);
-	if (ret != DA280_CHIP_ID)
-		return ret == -ETIMEDOUT ? -ETIMEDOUT : -ENODEV;
+	ret = q8_hardwaremgr_transfer(client->adapter, msgs, num);
+	if (ret == num)
+		return 0;
 
-	/* da226 (2-axis) or da280 (3-axis) ? measure once to detect */
-	ret = i2c_smbus_write_byte_data(client, DA280_REG_MODE_BW,
-					DA280_MODE_ENABLE);
-	if (ret)
-		return ret == -ETIMEDOUT ? -ETIMEDOUT : -ENODEV;
+	return ret < 0 ? ret : -EIO;
+}
 
-	msleep(10);
+static int __q8_detect q8_hardwaremgr_read_regs(struct i2c_client *client,
+						u8 reg, u8 *buf, u16 len)
+{
+	struct i2c_msg msgs[2] = {
+		{ .addr = client->addr, .flags = 0, .len = 1, .buf = &reg },
+		{ .addr = client->addr, .flags = I2C_M_RD, .len = len,
+		  .buf = buf },
+	};
 
-	ret = i2c_smbus_read_word_data(client, DA280_REG_ACC_Z_LSB);
-	if (ret < 0)
-		return ret == -ETIMEDOUT ? -ETIMEDOUT : -ENODEV;
+	return q8_hardwaremgr_xfer(client, msgs, ARRAY_SIZE(msgs));
+}
 
-	/* If not present Z reports max pos value (14 bits, 2 low bits 0) */
-	if (ret == 32764) {
-		data->accelerometer.compatible = "miramems,da226";
-		data->accelerometer.model = da226;
-	} else {
-		data->accelerometer.compatible = "miramems,da280";
-		data->accelerometer.model = da280;
+#define Q8_HARDWAREMGR_MAX_REGS		4
+
+/*
+ * Read a list of (not necessarily contiguous) registers in a single
+ * i2c transaction, using repeated starts between the register reads.
+ */
+static int __q8_detect q8_hardwaremgr_read_reg_list(struct i2c_client *client,
+						    const u8 *regs, u8 *vals,
+						    int count)
+{
+	struct i2c_msg msgs[2 * Q8_HARDWAREMGR_MAX_REGS];
+	int i;
+
+	if (WARN_ON(count > Q8_HARDWAREMGR_MAX_REGS))
+		return -EINVAL;
+
+	for (i = 0; i < count; i++) {
+		msgs[2 * i].addr = client->addr;
+		msgs[2 * i].flags = 0;
+		msgs[2 * i].len = 1;
+		msgs[2 * i].buf = (u8 *)&regs[i];
+		msgs[2 * i + 1].addr = client->addr;
+		msgs[2 * i + 1].flags = I2C_M_RD;
+		msgs[2 * i + 1].len = 1;
+		msgs[2 * i + 1].buf = &vals[i];
 	}
 
-	ret = i2c_smbus_write_byte_data(client, DA280_REG_MODE_BW,
-					DA280_MODE_DISABLE);
+	return q8_hardwaremgr_xfer(client, msgs, 2 * count);
+}
+
+/*
+ * Secondary id check for chips with a single id register: read the id
+ * register, a data register and the id again (or through an alias of the
+ * id register, id2) in a single transaction, comparing only the id bits
+ * in mask. Returns the id or a negative errno and sets *confidence. Both
+ * id reads must match for more than low confidence. A data register which
+ * does not read as the id shows that the chip decodes register addresses,
+ * unlike a floating bus or a device returning the same byte for every
+ * read. A real sample can equal the id though, e.g. a small x value on a
+ * tablet lying flat, so that only costs medium confidence, it does not
+ * reject the chip.
+ */
+static int __q8_detect q8_hardwaremgr_read_id(struct i2c_client *client,
+					      u8 reg, u8 id2, u8 data_reg,
+					      u8 mask, int *confidence)
+{
+	const u8 regs[3] = { reg, data_reg, id2 };
+	u8 vals[3];
+	int ret;
+
+	ret = q8_hardwaremgr_read_reg_list(client, regs, vals, 3);
 	if (ret)
-		return ret == -ETIMEDOUT ? -ETIMEDOUT : -ENODEV;
+		return ret;
 
-	return 0;
+	if ((vals[0] & mask) != (vals[2] & mask))
+		*confidence = Q8_CONFIDENCE_LOW;
+	else if ((vals[1] & mask) != (vals[0] & mask))
+		*confidence = Q8_CONFIDENCE_MEDIUM;
+	else
+		*confidence = Q8_CONFIDENCE_STABLE;
+
+	return vals[0];
 }
 
-static int q8_hardwaremgr_probe_da311(struct q8_hardwaremgr_data *data,
-				      struct i2c_client *client)
+static int __q8_detect q8_hardwaremgr_read_byte_data(struct i2c_client *client,
+						     u8 reg)
 {
-	int id;
+	u8 val;
+	int ret;
 
-	id = i2c_smbus_read_byte_data(client, DA311_REG_CHIP_ID);
-	if (id == DA311_CHIP_ID) {
-		data->accelerometer.compatible = "miramems,da311";
-		data->accelerometer.model = da311;
-		return 0;
-	}
+	ret = q8_hardwaremgr_read_regs(client, reg, &val, 1);
+	return ret ? ret : val;
+}
 
-	return id == -ETIMEDOUT ? -ETIMEDOUT : -ENODEV;
+static int __q8_detect q8_hardwaremgr_read_word_data(struct i2c_client *client,
+						     u8 reg)
+{
+	__le16 val;
+	int ret;
+
+	ret = q8_hardwaremgr_read_regs(client, reg, (u8 *)&val, 2);
+	return ret ? ret : le16_to_cpu(val);
 }
 
-static int q8_hardwaremgr_probe_accelerometer(struct q8_hardwaremgr_data *data,
-					      struct i2c_adapter *adap)
+static int __q8_detect q8_hardwaremgr_read_word_swapped(
+	struct i2c_client *client, u8 reg)
 {
-	/* The rda599x wifi/bt/fm shares the i2c bus with the accelerometer */
-	PROBE_CLIENT(NULL,		   0x11, q8_hardwaremgr_probe_rda599x);
-	PROBE_CLIENT(&data->accelerometer, 0x15, q8_hardwaremgr_probe_mxc6225);
-	PROBE_CLIENT(&data->accelerometer, 0x4c, q8_hardwaremgr_probe_mc3230);
-	PROBE_CLIENT(&data->accelerometer, 0x1c, q8_hardwaremgr_probe_dmard06);
-	PROBE_CLIENT(&data->accelerometer, 0x1d, q8_hardwaremgr_probe_dmard09);
-	PROBE_CLIENT(&data->accelerometer, 0x18, q8_hardwaremgr_probe_dmard10);
-	PROBE_CLIENT(&data->accelerometer, 0x26, q8_hardwaremgr_probe_da280);
-	PROBE_CLIENT(&data->accelerometer, 0x27, q8_hardwaremgr_probe_da280);
-	PROBE_CLIENT(&data->accelerometer, 0x27, q8_hardwaremgr_probe_da311);
+	__be16 val;
+	int ret;
 
-	return -ENODEV;
+	ret = q8_hardwaremgr_read_regs(client, reg, (u8 *)&val, 2);
+	return ret ? ret : be16_to_cpu(val);
 }
 
-static void q8_hardwaremgr_apply_accelerometer(struct q8_hardwaremgr_data *data)
+static int __q8_detect q8_hardwaremgr_write_byte_data(struct i2c_client *client,
+						      u8 reg, u8 val)
 {
-	struct of_changeset cset;
-	struct device_node *np;
+	u8 buf[2] = { reg, val };
+	struct i2c_msg msg = {
+		.addr = client->addr, .flags = 0, .len = 2, .buf = buf,
+	};
 
-	if (data->accelerometer.model == accel_unknown)
-		return;
+	return q8_hardwaremgr_xfer(client, &msg, 1);
+}
 
-	np = q8_hardware_mgr_apply_common(&data->accelerometer, &cset,
-					  "accelerometer");
-	if (!np)
-		return;
+static int __q8_detect q8_hardwaremgr_master_recv(struct i2c_client *client,
+						  u8 *buf, u16 len)
+{
+	struct i2c_msg msg = {
+		.addr = client->addr, .flags = I2C_M_RD, .len = len, .buf = buf,
+	};
+	int ret;
 
-	of_changeset_apply(&cset);
-	of_changeset_destroy(&cset);
-	of_node_put(np);
+	ret = q8_hardwaremgr_xfer(client, &msg, 1);
+	return ret ? ret : len;
 }
 
-static void q8_hardwaremgr_apply_quirks(struct q8_hardwaremgr_data *data)
+static int __q8_detect q8_hardwaremgr_master_send(struct i2c_client *client,
+						  u8 *buf, u16 len)
 {
-	struct device_node *np;
-	struct of_changeset cset;
+	struct i2c_msg msg = {
+		.addr = client->addr, .flags = 0, .len = len, .buf = buf,
+	};
+	int ret;
 
-	/* This A33 tzx-723q4 PCB tablet with esp8089 needs crystal_26M_en=1 */
-	if (data->soc == a33 && data->touchscreen.model == gsl1680_b482 &&
-	    data->accelerometer.model == dmard09 && !data->has_rda599x) {
-		dev_info(data->dev, "Applying crystal_26M_en=1 sdio_wifi quirk\n");
-		np = of_find_node_by_name(of_root, "sdio_wifi");
-		if (!np) {
-			dev_warn(data->dev, "Could not find sdio_wifi dt node\n");
-			return;
-		}
-		of_changeset_init(&cset);
-		of_changeset_add_property_u32(&cset, np,
-					      "esp,crystal-26M-en", 1);
-		of_changeset_apply(&cset);
-		of_changeset_destroy(&cset);
-		of_node_put(np);
+	ret = q8_hardwaremgr_xfer(client, &msg, 1);
+	return ret ? ret : len;
+}
+
+/*
+ * The probe functions only use the adapter and address of the client, so
+ * an unregistered client is used instead of an i2c_new_dummy() one, device
+ * registration must not be done with the adapter locked. It is allocated
+ * rather than on the stack because of the embedded struct device.
+ */
+static int __q8_detect q8_hardwaremgr_probe_client(
+	struct q8_hardwaremgr_data *data, struct q8_hardwaremgr_device *dev,
+	struct i2c_adapter *adap, u16 addr, client_probe_func client_probe)
+{
+	struct i2c_client *client;
+	int ret;
+
+	client = kzalloc(sizeof(*client), GFP_KERNEL);
+	if (!client)
+		return -ENOMEM;
+
+	client->adapter = adap;
+	client->addr = addr;
+
+	/* ret will be one of 0: Success, -ETIMEDOUT: Bus stuck or -ENODEV */
+	ret = client_probe(data, client);
+	if (ret == 0)
+		dev->addr = addr;
+
+	kfree(client);
+
+	return ret;
+}
+
+/*
+ * The candidates for a bus are tried in order of how often a chip has matched
+ * at their address before, candidates with equal hit counts are tried in
+ * table order. On a fleet where a few combinations dominate this makes the
+ * common case take the fewest transfers and sleeps. Candidates sharing an
+ * address always stay in table order, the earlier one's probe may be needed
+ * to tell the chips apart (e.g. da280 and da311 at 0x27).
+ */
+struct q8_hardwaremgr_candidate {
+	u16 addr;
+	client_probe_func probe;
+	bool writes; /* Probe writes to the chip */
+};
+
+#define Q8_HARDWAREMGR_MAX_CANDIDATES	16
+
+static bool prescan = true;
+module_param(prescan, bool, 0644);
+MODULE_PARM_DESC(prescan, "Check which candidate addresses ACK before identifying chips");
+
+/*
+ * Check which of the candidate addresses ACK with a single byte read, so
+ * that the (multi-byte) identification transfers, and sleeps, are only done
+ * for addresses where there is a chip. A single byte read is used instead of
+ * a zero length (quick) write, since some controllers do not support zero
+ * length messages and we want to avoid writes while probing.
+ */
+static int __q8_detect q8_hardwaremgr_prescan(struct i2c_adapter *adap,
+	const struct q8_hardwaremgr_candidate *candidates, int count,
+	unsigned long *present)
+{
+	DECLARE_BITMAP(scanned, Q8_HARDWAREMGR_ADDR_COUNT);
+	struct i2c_msg msg;
+	u8 val;
+	int i, ret;
+
+	bitmap_zero(scanned, Q8_HARDWAREMGR_ADDR_COUNT);
+	bitmap_zero(present, Q8_HARDWAREMGR_ADDR_COUNT);
+
+	for (i = 0; i < count; i++) {
+		if (test_and_set_bit(candidates[i].addr, scanned))
+			continue;
+
+		msg.addr = candidates[i].addr;
+		msg.flags = I2C_M_RD;
+		msg.len = 1;
+		msg.buf = &val;
+
+		ret = q8_hardwaremgr_transfer(adap, &msg, 1);
+		if (ret == 1)
+			set_bit(candidates[i].addr, present);
+		else if (ret == -ETIMEDOUT)
+			return ret; /* Bus stuck bail immediately */
 	}
+
+	return 0;
 }
 
-static int q8_hardwaremgr_do_probe(struct q8_hardwaremgr_data *data,
-				   struct q8_hardwaremgr_device *dev,
-				   const char *prefix, bus_probe_func func)
+/* Report a low confidence match and forget it, so probing continues */
+static void __q8_detect q8_hardwaremgr_reject(struct q8_hardwaremgr_data *data,
+					      struct q8_hardwaremgr_device *dev)
 {
-	struct device_node *np;
-	struct pinctrl *pinctrl;
-	struct i2c_adapter *adap;
-	struct regulator *reg;
-	struct gpio_desc *gpio;
-	
-	int ret = 0;
+	dev_warn_ratelimited(data->dev, "Not applying %s at 0x%02x, confidence %d < %d\n",
+			     dev->compatible, dev->addr, dev->confidence, min_confidence);
 
-	np = of_find_node_by_name(of_root, prefix);
-	if (!np) {
-		dev_err(data->dev, "Error %s node is missing\n", prefix);
-		return -EINVAL;
+	if (dev->confidence > dev->rejected_confidence) {
+		dev->rejected_model = dev->model;
+		dev->rejected_addr = dev->addr;
+		dev->rejected_confidence = dev->confidence;
+	}
+
+	dev->model = 0;
+	dev->addr = 0;
+	dev->confidence = 0;
+	dev->compatible = NULL;
+}
+
+static int __q8_detect q8_hardwaremgr_probe_candidates(
+	struct q8_hardwaremgr_data *data, struct q8_hardwaremgr_device *dev,
+	struct i2c_adapter *adap,
+	const struct q8_hardwaremgr_candidate *candidates, unsigned int *hits,
+	struct q8_hardwaremgr_bus_stats *stats, int count)
+{
+	struct q8_hardwaremgr_bus_stats snap;
+	DECLARE_BITMAP(present, Q8_HARDWAREMGR_ADDR_COUNT);
+	unsigned int addr_hits[Q8_HARDWAREMGR_MAX_CANDIDATES];
+	int order[Q8_HARDWAREMGR_MAX_CANDIDATES];
+	bool legacy = data->legacy_engine;
+	bool do_prescan = !legacy &&
+		(adap ? prescan : q8_hardwaremgr_replay_state.prescan);
+	int i, j, ret;
+
+	if (WARN_ON(count > Q8_HARDWAREMGR_MAX_CANDIDATES))
+		count = Q8_HARDWAREMGR_MAX_CANDIDATES;
+
+	for (i = 0; i < count; i++) {
+		addr_hits[i] = 0;
+		for (j = 0; j < count; j++)
+			if (candidates[j].addr == candidates[i].addr)
+				addr_hits[i] += hits[j];
 	}
 
 	/*
-	 * Patch the dt_node into our device since there is no device for
-	 * the probed hw yet (status = disabled) .
+	 * Stable insertion sort, most hits per address first, legacy uses
+	 * table order.
 	 */
-	data->dev->of_node = np;
+	for (i = 0; i < count; i++) {
+		for (j = i; !legacy && j > 0 &&
+			    addr_hits[order[j - 1]] < addr_hits[i]; j--)
+			order[j] = order[j - 1];
+		order[j] = i;
+	}
 
-	pinctrl = pinctrl_get(data->dev);
-	if (IS_ERR(pinctrl)) {
-		ret = PTR_ERR(pinctrl);
-		if (ret == -EPROBE_DEFER)
-			goto put_node;
-		pinctrl = NULL;
+	if (do_prescan) {
+		ret = q8_hardwaremgr_prescan(adap, candidates, count, present);
+		if (ret)
+			return ret;
 	}
 
-	if (pinctrl) {	
-		struct pinctrl_state *state = 
-			pinctrl_lookup_state(pinctrl, PINCTRL_STATE_DEFAULT);
-		if (!IS_ERR(state)) {
-			ret = pinctrl_select_state(pinctrl, state);
-			if (ret == -EPROBE_DEFER)
-				goto put_pinctrl;
+	for (i = 0; i < count; i++) {
+		const struct q8_hardwaremgr_candidate *c = &candidates[order[i]];
+
+		if (do_prescan && !test_bit(c->addr, present))
+			continue;
+
+		if (data->read_only && c->writes)
+			continue;
+
+		if (stats)
+			q8_hardwaremgr_stats_begin(adap, &snap);
+		ret = q8_hardwaremgr_probe_client(data, dev, adap, c->addr,
+						  c->probe);
+		if (stats)
+			q8_hardwaremgr_stats_end(adap, &snap,
+						 &stats[order[i]]);
+		if (ret == 0 && dev->confidence < min_confidence) {
+			q8_hardwaremgr_reject(data, dev);
+			ret = -ENODEV;
 		}
+		if (ret == 0 && !legacy)
+			hits[order[i]]++;
+		if (ret != -ENODEV)
+			return ret;
 	}
 
-	adap = of_get_i2c_adapter_by_node(np->parent);
-	if (!adap) {
-		ret = -EPROBE_DEFER;
-		goto put_pinctrl;
-	}
+	return -ENODEV;
+}
 
-	reg = regulator_get_optional(data->dev, "vddio");
-	if (IS_ERR(reg)) {
-		ret = PTR_ERR(reg);
-		if (ret == -EPROBE_DEFER)
-			goto put_adapter;
-		reg = NULL;
+static int __q8_detect q8_hardwaremgr_probe_silead(
+	struct q8_hardwaremgr_data *data, struct i2c_client *client)
+{
+	__le32 chip_id;
+	int ret;
+
+	ret = q8_hardwaremgr_read_regs(client, SILEAD_REG_ID, (u8 *)&chip_id,
+				       sizeof(chip_id));
+	if (ret)
+		return ret == -ETIMEDOUT ? -ETIMEDOUT : -ENODEV;
+
+	switch (le32_to_cpu(chip_id)) {
+	case 0xa0820000:
+		data->touchscreen.compatible =
+			touchscreen_compatibles[gsl1680_a082];
+		data->touchscreen.model = gsl1680_a082;
+		data->touchscreen.confidence = Q8_CONFIDENCE_HIGH;
+		q8_hardwaremgr_log(dev_info, data->dev, "Silead touchscreen ID: 0xa0820000\n");
+		return 0;
+	case 0xb4820000:
+		data->touchscreen.compatible =
+			touchscreen_compatibles[gsl1680_b482];
+		data->touchscreen.model = gsl1680_b482;
+		data->touchscreen.confidence = Q8_CONFIDENCE_HIGH;
+		q8_hardwaremgr_log(dev_info, data->dev, "Silead touchscreen ID: 0xb4820000\n");
+		return 0;
+	default:
+		dev_warn_ratelimited(data->dev, "Silead? touchscreen with unknown ID: 0x%08x\n",
+				     le32_to_cpu(chip_id));
 	}
 
-	gpio = fwnode_get_named_gpiod(&np->fwnode, "power-gpios");
-	if (IS_ERR(gpio)) {
-		ret = PTR_ERR(gpio);
-		if (ret == -EPROBE_DEFER)
-			goto put_reg;
-		gpio = NULL;
+	return -ENODEV;
+}
+
+static int __q8_detect q8_hardwaremgr_probe_ektf2127(
+	struct q8_hardwaremgr_data *data, struct i2c_client *client)
+{
+	unsigned char buff[4];
+	int ret;
+
+	/* Read hello, ignore data, depends on initial power state */
+	ret = q8_hardwaremgr_master_recv(client, buff, 4);
+	if (ret != 4)
+		return ret == -ETIMEDOUT ? -ETIMEDOUT : -ENODEV;
+
+	/* Request width */
+	buff[0] = EKTF2127_REQUEST;
+	buff[1] = EKTF2127_WIDTH;
+	buff[2] = 0x00;
+	buff[3] = 0x00;
+	ret = q8_hardwaremgr_master_send(client, buff, 4);
+	if (ret != 4)
+		return ret == -ETIMEDOUT ? -ETIMEDOUT : -ENODEV;
+
+	q8_hardwaremgr_msleep(client->adapter, 20);
+
+	/* Read response */
+	ret = q8_hardwaremgr_master_recv(client, buff, 4);
+	if (ret != 4)
+		return ret == -ETIMEDOUT ? -ETIMEDOUT : -ENODEV;
+
+	if (buff[0] == EKTF2127_RESPONSE && buff[1] == EKTF2127_WIDTH) {
+		data->touchscreen.compatible =
+			touchscreen_compatibles[ektf2127];
+		data->touchscreen.model = ektf2127;
+		data->touchscreen.confidence = Q8_CONFIDENCE_HIGH;
+		return 0;
+	}
+
+	return -ENODEV;
+}
+
+static int __q8_detect q8_hardwaremgr_probe_zet6251(
+	struct q8_hardwaremgr_data *data, struct i2c_client *client)
+{
+	unsigned char buff[24];
+	int ret;
+
+	/*
+	 * We only do a simple read finger data packet test, because some
+	 * versions require firmware to be loaded. If no firmware is loaded
+	 * the buffer will be filed with 0xff. Anything else than a valid
+	 * finger data packet or all 0xff is some other chip answering.
+	 */
+	ret = q8_hardwaremgr_master_recv(client, buff, 24);
+	if (ret != 24)
+		return ret == -ETIMEDOUT ? -ETIMEDOUT : -ENODEV;
+
+	data->touchscreen.compatible = touchscreen_compatibles[zet6251];
+	data->touchscreen.model = zet6251;
+	if (buff[0] == ZET6251_VALID_PACKET ||
+	    !memchr_inv(buff, 0xff, sizeof(buff)))
+		data->touchscreen.confidence = Q8_CONFIDENCE_MEDIUM;
+	else
+		data->touchscreen.confidence = Q8_CONFIDENCE_LOW;
+	return 0;
+}
+
+static const struct q8_hardwaremgr_candidate touchscreen_candidates[] __q8_detectconst = {
+	{ 0x40, q8_hardwaremgr_probe_silead },
+	{ 0x15, q8_hardwaremgr_probe_ektf2127, true },
+	{ 0x76, q8_hardwaremgr_probe_zet6251 },
+};
+
+static unsigned int touchscreen_hits[ARRAY_SIZE(touchscreen_candidates)];
+module_param_array(touchscreen_hits, uint, NULL, 0644);
+MODULE_PARM_DESC(touchscreen_hits, "Touchscreen candidate hit counters, used to order probing");
+
+static struct q8_hardwaremgr_bus_stats
+	touchscreen_stats[ARRAY_SIZE(touchscreen_candidates)];
+
+static int __q8_detect q8_hardwaremgr_probe_touchscreen(
+	struct q8_hardwaremgr_data *data, struct i2c_adapter *adap)
+{
+	unsigned int *hits = !adap ?
+				q8_hardwaremgr_replay_state.touchscreen_hits :
+				data->touchscreen_hits ?: touchscreen_hits;
+	int ret;
+
+	if (!data->powered)
+		q8_hardwaremgr_msleep(adap, TOUCHSCREEN_POWER_ON_DELAY);
+
+	q8_hardwaremgr_lock_bus(adap);
+	ret = q8_hardwaremgr_probe_candidates(data, &data->touchscreen, adap,
+					      touchscreen_candidates, hits,
+					      adap ? touchscreen_stats : NULL,
+					      ARRAY_SIZE(touchscreen_candidates));
+	q8_hardwaremgr_unlock_bus(adap);
+
+	return ret;
+}
+
+/*
+ * Touchscreen configuration is resolved from a per touchscreen model rule
+ * table. The first rule matching the soc, accelerometer model / address and
+ * rda599x presence wins, so more specific rules must come first and each
+ * table ends with a catch-all rule. These accelerometer based heuristics
+ * select the best default based on known q8 tablets, new batches can be
+ * supported by adding rows. The rules are looked up through an index on
+ * all of the matched fields, built from the tables at init.
+ */
+#define Q8_ANY				-1
+
+struct q8_hardwaremgr_ts_variant {
+	int width;
+	int height;
+	int swap_x_y;
+	const char *fw_name;
+};
+
+struct q8_hardwaremgr_ts_rule {
+	int soc;
+	int accel_model;
+	int accel_addr;
+	int rda599x;
+	int variant;
+	int invert_x;
+	int invert_y;
+	unsigned int quirks;
+};
+
+struct q8_hardwaremgr_ts_model {
+	const struct q8_hardwaremgr_ts_variant *variants;
+	int variant_count;
+	const struct q8_hardwaremgr_ts_rule *rules;
+	int rule_count;
+};
+
+#define Q8_TS_MATCH(_soc, _model, _addr, _rda) \
+	.soc = _soc, .accel_model = _model, .accel_addr = _addr, .rda599x = _rda
+
+static const struct q8_hardwaremgr_ts_variant gsl1680_a082_variants[] __q8_detectconst = {
+	{ 1024, 600, 0, "gsl1680-a082-q8-700.fw" },
+	{  480, 800, 1, "gsl1680-a082-q8-a70.fw" },
+};
+
+static const struct q8_hardwaremgr_ts_rule gsl1680_a082_rules[] __q8_detectconst = {
+	{ Q8_TS_MATCH(Q8_ANY, mc3230,  Q8_ANY, Q8_ANY), .invert_x = 1 },
+	{ Q8_TS_MATCH(Q8_ANY, dmard10, Q8_ANY, Q8_ANY), .variant = 1 },
+	{ Q8_TS_MATCH(Q8_ANY, mxc6225, Q8_ANY, Q8_ANY), .variant = 1 },
+	{ Q8_TS_MATCH(Q8_ANY, Q8_ANY,  Q8_ANY, Q8_ANY) },
+};
+
+static const struct q8_hardwaremgr_ts_variant gsl1680_b482_variants[] __q8_detectconst = {
+	{ 960, 640, 0, "gsl1680-b482-q8-d702.fw" },
+	{ 960, 640, 0, "gsl1680-b482-q8-a70.fw" },
+};
+
+static const struct q8_hardwaremgr_ts_rule gsl1680_b482_rules[] __q8_detectconst = {
+	{ Q8_TS_MATCH(Q8_ANY, da280,   0x27,   Q8_ANY) },
+	{ Q8_TS_MATCH(Q8_ANY, da280,   Q8_ANY, 1),      .invert_x = 1 },
+	{ Q8_TS_MATCH(Q8_ANY, da280,   Q8_ANY, 0),      .invert_y = 1 },
+#if Q8_HWMGR_BUILD_A33
+	/* This A33 tzx-723q4 PCB tablet with esp8089 needs crystal_26M_en=1 */
+	{ Q8_TS_MATCH(a33,    dmard09, Q8_ANY, 0),      .invert_x = 1,
+	  .quirks = Q8_HWMGR_QUIRK_ESP_CRYSTAL_26M },
+#endif
+	{ Q8_TS_MATCH(Q8_ANY, dmard09, Q8_ANY, Q8_ANY), .invert_x = 1 },
+	{ Q8_TS_MATCH(Q8_ANY, mxc6225, Q8_ANY, Q8_ANY), .variant = 1 },
+	{ Q8_TS_MATCH(Q8_ANY, Q8_ANY,  Q8_ANY, Q8_ANY) },
+};
+
+/* ektf2127 and zet6251 have only 1 variant and need no heuristics */
+static const struct q8_hardwaremgr_ts_model touchscreen_models[] __q8_detectconst = {
+	[gsl1680_a082] = {
+		gsl1680_a082_variants, ARRAY_SIZE(gsl1680_a082_variants),
+		gsl1680_a082_rules, ARRAY_SIZE(gsl1680_a082_rules),
+	},
+	[gsl1680_b482] = {
+		gsl1680_b482_variants, ARRAY_SIZE(gsl1680_b482_variants),
+		gsl1680_b482_rules, ARRAY_SIZE(gsl1680_b482_rules),
+	},
+	[ektf2127] = { },
+	[zet6251] = { },
+};
+
+/*
+ * Only a few rows match on the accelerometer address, the addresses they
+ * name get an index slot each, slot 0 is for all other addresses. Index
+ * entries hold the rule row + 1, 0 if no row matches.
+ */
+#define Q8_TS_RULE_ADDR_SLOTS		4
+#define Q8_TS_RULE_ADDR_COUNT		128
+
+static u8 q8_hardwaremgr_ts_rule_addr_slot[Q8_TS_RULE_ADDR_COUNT]
+	__q8_detectdata;
+static u8 q8_hardwaremgr_ts_rule_index[ARRAY_SIZE(touchscreen_models)]
+	[ARRAY_SIZE(soc_names)][ARRAY_SIZE(accelerometer_model_names)]
+	[Q8_TS_RULE_ADDR_SLOTS][2] __q8_detectdata;
+
+static bool __q8_detect q8_hardwaremgr_ts_rule_matches(
+	const struct q8_hardwaremgr_ts_rule *rule, int soc, int accel_model,
+	int accel_addr, int rda599x)
+{
+	return (rule->soc == Q8_ANY || rule->soc == soc) &&
+	       (rule->accel_model == Q8_ANY ||
+		rule->accel_model == accel_model) &&
+	       (rule->accel_addr == Q8_ANY ||
+		rule->accel_addr == accel_addr) &&
+	       (rule->rda599x == Q8_ANY || rule->rda599x == rda599x);
+}
+
+static int __q8_detect q8_hardwaremgr_ts_rule_first_match(
+	const struct q8_hardwaremgr_ts_model *model, int soc, int accel_model,
+	int accel_addr, int rda599x)
+{
+	int i;
+
+	for (i = 0; i < model->rule_count; i++)
+		if (q8_hardwaremgr_ts_rule_matches(&model->rules[i], soc,
+						   accel_model, accel_addr,
+						   rda599x))
+			return i + 1;
+
+	return 0;
+}
+
+static void __q8_detect q8_hardwaremgr_index_ts_model(int ts, int soc,
+	int accel, const int *addrs, int slots)
+{
+	u8 (*entry)[2] = q8_hardwaremgr_ts_rule_index[ts][soc][accel];
+	int slot, rda;
+
+	for (slot = 0; slot < slots; slot++)
+		for (rda = 0; rda < 2; rda++)
+			entry[slot][rda] = q8_hardwaremgr_ts_rule_first_match(
+						&touchscreen_models[ts], soc,
+						accel, addrs[slot], rda);
+}
+
+static void __q8_detect q8_hardwaremgr_index_ts_rules(void)
+{
+	int addrs[Q8_TS_RULE_ADDR_SLOTS] = { 0 }; /* 0 never matches a row */
+	int ts, i, soc, accel, slots = 1;
+
+	for (ts = 0; ts < ARRAY_SIZE(touchscreen_models); ts++) {
+		const struct q8_hardwaremgr_ts_model *model =
+			&touchscreen_models[ts];
+
+		for (i = 0; i < model->rule_count; i++) {
+			int addr = model->rules[i].accel_addr;
+
+			if (addr == Q8_ANY ||
+			    q8_hardwaremgr_ts_rule_addr_slot[addr])
+				continue;
+
+			if (WARN_ON(slots == Q8_TS_RULE_ADDR_SLOTS))
+				break;
+
+			addrs[slots] = addr;
+			q8_hardwaremgr_ts_rule_addr_slot[addr] = slots++;
+		}
+	}
+
+	for (ts = 0; ts < ARRAY_SIZE(touchscreen_models); ts++)
+		for (soc = 0; soc < ARRAY_SIZE(soc_names); soc++)
+			for (accel = 0;
+			     accel < ARRAY_SIZE(accelerometer_model_names);
+			     accel++)
+				q8_hardwaremgr_index_ts_model(ts, soc, accel,
+							      addrs, slots);
+}
+
+static const struct q8_hardwaremgr_ts_rule * __q8_detect
+q8_hardwaremgr_find_ts_rule(struct q8_hardwaremgr_data *data)
+{
+	int ts = data->touchscreen.model;
+	int accel = data->accelerometer.model;
+	int addr = data->accelerometer.addr;
+	int slot, row;
+
+	if (ts >= ARRAY_SIZE(touchscreen_models) ||
+	    accel >= ARRAY_SIZE(accelerometer_model_names))
+		return NULL;
+
+	slot = addr < Q8_TS_RULE_ADDR_COUNT ?
+		q8_hardwaremgr_ts_rule_addr_slot[addr] : 0;
+	row = q8_hardwaremgr_ts_rule_index[ts][q8_hardwaremgr_soc(data)]
+					  [accel][slot][data->has_rda599x];
+
+	return row ? &touchscreen_models[ts].rules[row - 1] : NULL;
+}
+
+/*
+ * Different rows can have the same outcome, e.g. the catch-all row and a
+ * row for a specific accelerometer, compare what gets applied. No rule
+ * means no settings.
+ */
+static bool __q8_detect q8_hardwaremgr_ts_rule_equivalent(
+	const struct q8_hardwaremgr_ts_rule *a,
+	const struct q8_hardwaremgr_ts_rule *b)
+{
+	static const struct q8_hardwaremgr_ts_rule none;
+
+	if (!a)
+		a = &none;
+	if (!b)
+		b = &none;
+
+	return a->variant == b->variant && a->invert_x == b->invert_x &&
+	       a->invert_y == b->invert_y && a->quirks == b->quirks;
+}
+
+static void __q8_detect q8_hardwaremgr_resolve_touchscreen(
+	struct q8_hardwaremgr_data *data)
+{
+	const struct q8_hardwaremgr_ts_model *model;
+	const struct q8_hardwaremgr_ts_variant *variant;
+	const struct q8_hardwaremgr_ts_rule *rule;
+
+	if (data->touchscreen.model >= ARRAY_SIZE(touchscreen_models))
+		return;
+
+	model = &touchscreen_models[data->touchscreen.model];
+	rule = q8_hardwaremgr_find_ts_rule(data);
+	data->touchscreen_rule = rule;
+
+	/* Quirks are board properties, they apply regardless of overrides */
+	if (rule)
+		data->quirks |= rule->quirks;
+
+	if (touchscreen_variant != -1) {
+		data->touchscreen_variant = touchscreen_variant;
+	} else if (rule) {
+		data->touchscreen_variant = rule->variant;
+		data->touchscreen_invert_x = rule->invert_x;
+		data->touchscreen_invert_y = rule->invert_y;
+	}
+
+	if (!model->variant_count)
+		return;
+
+	if (data->touchscreen_variant < 0 ||
+	    data->touchscreen_variant >= model->variant_count) {
+		dev_warn(data->dev, "Error unknown touchscreen_variant %d using 0\n",
+			 touchscreen_variant);
+		data->touchscreen_variant = 0;
+	}
+
+	variant = &model->variants[data->touchscreen_variant];
+	data->touchscreen_width = variant->width;
+	data->touchscreen_height = variant->height;
+	data->touchscreen_swap_x_y = variant->swap_x_y;
+	data->touchscreen_fw_name = variant->fw_name;
+}
+
+static void __q8_detect q8_hardwaremgr_issue_gsl1680_warning(
+	struct q8_hardwaremgr_data *data)
+{
+	q8_hardwaremgr_log(dev_warn, data->dev, "gsl1680 touchscreen may require kernel cmdline parameters to function properly\n");
+	q8_hardwaremgr_log(dev_warn, data->dev, "Try q8_hardwaremgr.touchscreen_invert_x=%d if x coordinates are inverted\n",
+			   !data->touchscreen_invert_x);
+	q8_hardwaremgr_log(dev_warn, data->dev, "Try q8_hardwaremgr.touchscreen_variant=%d if coordinates are all over the place\n",
+			   !data->touchscreen_variant);
+
+#define	show(x) \
+	q8_hardwaremgr_log(dev_info, data->dev, #x " %d (%s)\n", data->x, \
+			   (x == -1) ? "auto" : "user supplied")
+
+	show(touchscreen_variant);
+	show(touchscreen_width);
+	show(touchscreen_height);
+	show(touchscreen_invert_x);
+	show(touchscreen_invert_y);
+	show(touchscreen_swap_x_y);
+	q8_hardwaremgr_log(dev_info, data->dev, "touchscreen_fw_name %s (%s)\n",
+			   data->touchscreen_fw_name,
+			   (touchscreen_fw_name == NULL) ? "auto" : "user supplied");
+#undef show
+}
+
+/*
+ * We track when the touchscreen and accelerometer drivers bind and register
+ * their input / iio devices, to release the prefetched firmware and to
+ * measure the time from module init (or rescan) until the hardware is
+ * usable. Times are in ns, 0 means not (yet) happened.
+ */
+static u64 q8_hardwaremgr_init_ns;
+
+static const char * const timing_names[] = {
+	[timing_start]			 = "start",
+	[timing_probe]			 = "probe",
+	[timing_detected]		 = "detected",
+	[timing_applied]		 = "applied",
+	[timing_touchscreen_bound]	 = "touchscreen_bound",
+	[timing_touchscreen_registered]	 = "touchscreen_registered",
+	[timing_accelerometer_bound]	 = "accelerometer_bound",
+	[timing_accelerometer_registered] = "accelerometer_registered",
+};
+
+static s64 q8_hardwaremgr_us(struct q8_hardwaremgr_data *data, int which)
+{
+	if (!data->timing[which])
+		return -1;
+
+	return div_s64(data->timing[which] - data->timing[timing_start],
+		       NSEC_PER_USEC);
+}
+
+/*
+ * Must be called with timing_lock held, returns true and snapshots the
+ * times to report in us[] once the hardware is ready. The caller logs them
+ * after dropping the lock, printk with irqs off can be slow.
+ */
+static bool q8_hardwaremgr_report_timing(struct q8_hardwaremgr_data *data,
+					 s64 *us)
+{
+	bool ts = data->touchscreen.applied;
+	bool accel = data->accelerometer.applied;
+
+	if (data->timing_reported || !data->timing[timing_applied] ||
+	    (!ts && !accel) ||
+	    (ts && !data->timing[timing_touchscreen_registered]) ||
+	    (accel && !data->timing[timing_accelerometer_registered]))
+		return false;
+
+	us[0] = q8_hardwaremgr_us(data, timing_detected);
+	us[1] = q8_hardwaremgr_us(data, timing_applied);
+	us[2] = q8_hardwaremgr_us(data, timing_touchscreen_registered);
+	us[3] = q8_hardwaremgr_us(data, timing_accelerometer_registered);
+	data->timing_reported = true;
+	return true;
+}
+
+static void q8_hardwaremgr_mark(struct q8_hardwaremgr_data *data, int which)
+{
+	unsigned long flags;
+	bool report;
+	s64 us[4];
+
+	spin_lock_irqsave(&data->timing_lock, flags);
+	if (!data->timing[which])
+		data->timing[which] = ktime_get_ns();
+	report = q8_hardwaremgr_report_timing(data, us);
+	spin_unlock_irqrestore(&data->timing_lock, flags);
+
+	if (report)
+		q8_hardwaremgr_log(dev_info, data->dev, "Time to hw ready: detect %lld us, apply %lld us, touchscreen %lld us, accelerometer %lld us\n",
+				   us[0], us[1], us[2], us[3]);
+}
+
+static void __q8_detect q8_hardwaremgr_timing_start(
+	struct q8_hardwaremgr_data *data, u64 start)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&data->timing_lock, flags);
+	memset(data->timing, 0, sizeof(data->timing));
+	data->timing[timing_start] = start;
+	data->timing_reported = false;
+	spin_unlock_irqrestore(&data->timing_lock, flags);
+}
+
+static ssize_t timings_show(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+	struct q8_hardwaremgr_data *data = dev_get_drvdata(dev);
+	unsigned long flags;
+	ssize_t len = 0;
+	int i;
+
+	spin_lock_irqsave(&data->timing_lock, flags);
+	for (i = timing_probe; i < timing_count; i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s %lld\n",
+				 timing_names[i], q8_hardwaremgr_us(data, i));
+	spin_unlock_irqrestore(&data->timing_lock, flags);
+
+	return len;
+}
+static DEVICE_ATTR_RO(timings);
+
+static ssize_t shadow_show(struct device *dev, struct device_attribute *attr,
+			   char *buf)
+{
+	struct q8_hardwaremgr_data *data = dev_get_drvdata(dev);
+	ssize_t ret;
+
+	mutex_lock(&data->lock);
+	ret = scnprintf(buf, PAGE_SIZE, "%s", data->shadow_report);
+	mutex_unlock(&data->lock);
+
+	return ret;
+}
+static DEVICE_ATTR_RO(shadow);
+
+/*
+ * Only the pointer gets compared, the device holds a reference to its own
+ * node, so a match is never against a node which is being released.
+ */
+static bool q8_hardwaremgr_is_tracked(struct q8_hardwaremgr_data *data,
+				      struct device_node * const *tracked,
+				      struct device_node *np)
+{
+	unsigned long flags;
+	bool ret;
+
+	spin_lock_irqsave(&data->timing_lock, flags);
+	ret = np && *tracked == np;
+	spin_unlock_irqrestore(&data->timing_lock, flags);
+
+	return ret;
+}
+
+static bool q8_hardwaremgr_is_child_of(struct q8_hardwaremgr_data *data,
+				       struct device *dev,
+				       struct device_node * const *tracked)
+{
+	return dev->parent &&
+	       q8_hardwaremgr_is_tracked(data, tracked, dev->parent->of_node);
+}
+
+static int q8_hardwaremgr_input_connect(struct input_handler *handler,
+					struct input_dev *input,
+					const struct input_device_id *id)
+{
+	struct q8_hardwaremgr_data *data =
+		container_of(handler, struct q8_hardwaremgr_data,
+			     input_handler);
+
+	if (q8_hardwaremgr_is_child_of(data, &input->dev,
+				       &data->touchscreen_np))
+		q8_hardwaremgr_mark(data, timing_touchscreen_registered);
+
+	/* Some accelerometer drivers register an input device */
+	if (q8_hardwaremgr_is_child_of(data, &input->dev,
+				       &data->accelerometer_np))
+		q8_hardwaremgr_mark(data, timing_accelerometer_registered);
+
+	return -ENODEV; /* We only watch, never actually connect */
+}
+
+/* Match all input devices */
+static const struct input_device_id q8_hardwaremgr_input_ids[] = {
+	{ .driver_info = 1 },
+	{ }
+};
+
+#if IS_REACHABLE(CONFIG_IIO)
+static int q8_hardwaremgr_iio_notify(struct notifier_block *nb,
+				     unsigned long action, void *_dev)
+{
+	struct q8_hardwaremgr_data *data =
+		container_of(nb, struct q8_hardwaremgr_data, iio_nb);
+	struct device *dev = _dev;
+
+	if (action != BUS_NOTIFY_ADD_DEVICE ||
+	    !q8_hardwaremgr_is_child_of(data, dev, &data->accelerometer_np))
+		return NOTIFY_DONE;
+
+	q8_hardwaremgr_mark(data, timing_accelerometer_registered);
+	return NOTIFY_OK;
+}
+#endif
+
+static int q8_hardwaremgr_i2c_notify(struct notifier_block *nb,
+				     unsigned long action, void *_dev)
+{
+	struct q8_hardwaremgr_data *data =
+		container_of(nb, struct q8_hardwaremgr_data, i2c_nb);
+	struct device *dev = _dev;
+
+	if (action != BUS_NOTIFY_BOUND_DRIVER || !dev->of_node)
+		return NOTIFY_DONE;
+
+	if (q8_hardwaremgr_is_tracked(data, &data->accelerometer_np,
+				      dev->of_node)) {
+		q8_hardwaremgr_mark(data, timing_accelerometer_bound);
+		return NOTIFY_OK;
+	}
+
+	if (!q8_hardwaremgr_is_tracked(data, &data->touchscreen_np,
+				       dev->of_node))
+		return NOTIFY_DONE;
+
+	q8_hardwaremgr_mark(data, timing_touchscreen_bound);
+
+	mutex_lock(&data->fw_lock);
+	data->touchscreen_bound = true;
+	release_firmware(data->touchscreen_fw);
+	data->touchscreen_fw = NULL;
+	mutex_unlock(&data->fw_lock);
+
+	return NOTIFY_OK;
+}
+
+static int __q8_detect q8_hardwaremgr_watch(struct q8_hardwaremgr_data *data)
+{
+	int ret;
+
+	data->touchscreen_np = of_find_node_by_name(of_root, "touchscreen");
+	data->accelerometer_np = of_find_node_by_name(of_root,
+						      "accelerometer");
+
+	data->i2c_nb.notifier_call = q8_hardwaremgr_i2c_notify;
+	ret = bus_register_notifier(&i2c_bus_type, &data->i2c_nb);
+	if (ret)
+		goto put_nodes;
+
+	data->input_handler.connect = q8_hardwaremgr_input_connect;
+	data->input_handler.name = "q8-hwmgr";
+	data->input_handler.id_table = q8_hardwaremgr_input_ids;
+	ret = input_register_handler(&data->input_handler);
+	if (ret)
+		goto unregister_i2c;
+
+#if IS_REACHABLE(CONFIG_IIO)
+	data->iio_nb.notifier_call = q8_hardwaremgr_iio_notify;
+	ret = bus_register_notifier(&iio_bus_type, &data->iio_nb);
+	if (ret)
+		goto unregister_input;
+#endif
+
+	return 0;
+
+#if IS_REACHABLE(CONFIG_IIO)
+unregister_input:
+	input_unregister_handler(&data->input_handler);
+#endif
+unregister_i2c:
+	bus_unregister_notifier(&i2c_bus_type, &data->i2c_nb);
+put_nodes:
+	of_node_put(data->accelerometer_np);
+	of_node_put(data->touchscreen_np);
+	return ret;
+}
+
+static void q8_hardwaremgr_unwatch(struct q8_hardwaremgr_data *data)
+{
+#if IS_REACHABLE(CONFIG_IIO)
+	bus_unregister_notifier(&iio_bus_type, &data->iio_nb);
+#endif
+	input_unregister_handler(&data->input_handler);
+	bus_unregister_notifier(&i2c_bus_type, &data->i2c_nb);
+	of_node_put(data->accelerometer_np);
+	of_node_put(data->touchscreen_np);
+}
+
+/*
+ * Start loading the touchscreen firmware as soon as we know its name, so that
+ * the firmware I/O overlaps with the rest of boot. We keep a reference until
+ * the touchscreen driver has bound, which keeps the firmware in the firmware
+ * cache so the driver's own request_firmware() call does not hit the disk.
+ * The load is direct, without the usermode helper fallback, which could
+ * block a rescan or remove waiting for its timeout. If the file is not
+ * there, the driver's own request reports it.
+ */
+static void q8_hardwaremgr_fw_work(struct work_struct *work)
+{
+	struct q8_hardwaremgr_data *data =
+		container_of(work, struct q8_hardwaremgr_data, fw_work);
+	const struct firmware *fw = NULL;
+
+	if (request_firmware_direct(&fw, data->fw_path, data->dev))
+		fw = NULL;
+
+	mutex_lock(&data->fw_lock);
+	if (data->touchscreen_bound)
+		release_firmware(fw);
+	else
+		data->touchscreen_fw = fw;
+	mutex_unlock(&data->fw_lock);
+}
+
+static void __q8_detect q8_hardwaremgr_prefetch_firmware(
+	struct q8_hardwaremgr_data *data)
+{
+	if (!data->touchscreen_fw_name)
+		return;
+
+	/* The silead driver requests its firmware-name below silead/ */
+	data->fw_path = kasprintf(GFP_KERNEL, "silead/%s",
+				  data->touchscreen_fw_name);
+	if (!data->fw_path) {
+		dev_warn(data->dev, "Error prefetching %s %d\n",
+			 data->touchscreen_fw_name, -ENOMEM);
+		return;
+	}
+
+	data->touchscreen_bound = false;
+	queue_work(system_unbound_wq, &data->fw_work);
+	data->fw_requested = true;
+}
+
+static void q8_hardwaremgr_release_firmware(struct q8_hardwaremgr_data *data)
+{
+	if (!data->fw_requested)
+		return;
+
+	flush_work(&data->fw_work);
+	release_firmware(data->touchscreen_fw);
+	data->touchscreen_fw = NULL;
+	kfree(data->fw_path);
+	data->fw_path = NULL;
+	data->fw_requested = false;
+}
+
+static void __q8_detect q8_hardwaremgr_configure_touchscreen(
+	struct q8_hardwaremgr_data *data)
+{
+	if (data->touchscreen.model == touchscreen_unknown)
+		return;
+
+	q8_hardwaremgr_resolve_touchscreen(data);
+
+	if (touchscreen_width != -1)
+		data->touchscreen_width = touchscreen_width;
+
+	if (touchscreen_height != -1)
+		data->touchscreen_height = touchscreen_height;
+
+	if (touchscreen_invert_x != -1)
+		data->touchscreen_invert_x = touchscreen_invert_x;
+
+	if (touchscreen_invert_y != -1)
+		data->touchscreen_invert_y = touchscreen_invert_y;
+
+	if (touchscreen_swap_x_y != -1)
+		data->touchscreen_swap_x_y = touchscreen_swap_x_y;
+
+	/* The param may be changed (and freed) through sysfs, copy it */
+	kernel_param_lock(THIS_MODULE);
+	if (touchscreen_fw_name) {
+		kfree(data->user_fw_name);
+		data->user_fw_name = kstrdup(touchscreen_fw_name, GFP_KERNEL);
+		if (data->user_fw_name)
+			data->touchscreen_fw_name = data->user_fw_name;
+	}
+	kernel_param_unlock(THIS_MODULE);
+
+	if (data->touchscreen.model == gsl1680_a082 ||
+	    data->touchscreen.model == gsl1680_b482)
+		q8_hardwaremgr_issue_gsl1680_warning(data);
+}
+
+static void __q8_detect q8_hardwaremgr_apply_touchscreen(
+	struct q8_hardwaremgr_data *data)
+{
+	struct of_changeset *cset = &data->touchscreen.cset;
+	struct device_node *np;
+
+	if (data->touchscreen.model == touchscreen_unknown)
+		return;
+
+	np = q8_hardware_mgr_apply_common(&data->touchscreen, cset,
+					  "touchscreen");
+	if (!np)
+		return;
+
+	q8_hardwaremgr_track_node(data, &data->touchscreen_np, np);
+
+	if (data->touchscreen_width)
+		of_changeset_add_property_u32(cset, np, "touchscreen-size-x",
+					      data->touchscreen_width);
+	if (data->touchscreen_height)
+		of_changeset_add_property_u32(cset, np, "touchscreen-size-y",
+					      data->touchscreen_height);
+	if (data->touchscreen_invert_x)
+		of_changeset_add_property_bool(cset, np,
+					       "touchscreen-inverted-x");
+	if (data->touchscreen_invert_y)
+		of_changeset_add_property_bool(cset, np,
+					       "touchscreen-inverted-y");
+	if (data->touchscreen_swap_x_y)
+		of_changeset_add_property_bool(cset, np,
+					       "touchscreen-swapped-x-y");
+	if (data->touchscreen_fw_name)
+		of_changeset_add_property_string(cset, np, "firmware-name",
+						 data->touchscreen_fw_name);
+
+	q8_hardwaremgr_prefetch_firmware(data);
+
+	if (q8_hardwaremgr_commit_cset(data, cset, &data->touchscreen.applied))
+		q8_hardwaremgr_release_firmware(data);
+
+	of_node_put(np);
+}
+
+static int __q8_detect q8_hardwaremgr_probe_rda599x(
+	struct q8_hardwaremgr_data *data, struct i2c_client *client)
+{
+	int id;
+
+	/*
+	 * Check for the (integrated) rda580x / rda5820 fm receiver at 0x11
+	 *
+	 * Alternatively we could check for the wifi_rf i2c interface at
+	 * address 0x14, by selecting page/bank 1 through:
+	 * smbus_write_word_swapped(0x3f, 0x01)
+	 * and then doing a smbus_read_word_swapped(0x20) which will
+	 * return 0x5990 for a rda5990. We prefer the fm detect method since
+	 * we want to avoid doing any smbus_writes while probing.
+	 */
+	id = q8_hardwaremgr_read_word_swapped(client, 0x0c);
+	if (id == 0x5802 || id == 0x5803 || id == 0x5805 || id == 0x5820)
+		data->has_rda599x = true;
+
+	return id == -ETIMEDOUT ? -ETIMEDOUT : -ENODEV;
+}
+
+static int __q8_detect q8_hardwaremgr_probe_mxc6225(
+	struct q8_hardwaremgr_data *data, struct i2c_client *client)
+{
+	int confidence, id;
+
+	/* Bits 7 - 5 of the chip-id register are undefined */
+	id = q8_hardwaremgr_read_id(client, MXC6225_REG_CHIP_ID,
+				    MXC6225_REG_CHIP_ID, MXC6225_REG_XOUT,
+				    0x1f, &confidence);
+	if (id >= 0 && (id & 0x1f) == MXC6225_CHIP_ID) {
+		data->accelerometer.compatible =
+			accelerometer_compatibles[mxc6225];
+		data->accelerometer.model = mxc6225;
+		data->accelerometer.confidence = confidence;
+		return 0;
+	}
+
+	return id == -ETIMEDOUT ? -ETIMEDOUT : -ENODEV;
+}
+
+static int __q8_detect q8_hardwaremgr_probe_mc3230(
+	struct q8_hardwaremgr_data *data, struct i2c_client *client)
+{
+	static const u8 regs[2] = {
+		MC3230_REG_CHIP_ID, MC3230_REG_PRODUCT_CODE };
+	u8 vals[2], vals3[3];
+	int ret;
+
+	/* Read chip-id and product-id in one go, then check both */
+	ret = q8_hardwaremgr_read_reg_list(client, regs, vals, 2);
+	if (ret)
+		return ret == -ETIMEDOUT ? -ETIMEDOUT : -ENODEV;
+
+	if (vals[0] != MC3230_CHIP_ID && vals[0] != MMA7660_CHIP_ID)
+		return -ENODEV;
+
+	switch (vals[1]) {
+	case MMA7660_PRODUCT_CODE:
+		data->accelerometer.compatible =
+			accelerometer_compatibles[mma7660];
+		data->accelerometer.model = mma7660;
+		data->accelerometer.confidence = Q8_CONFIDENCE_MEDIUM;
+		break;
+	case MC3210_PRODUCT_CODE:
+		data->accelerometer.compatible =
+			accelerometer_compatibles[mc3210];
+		data->accelerometer.model = mc3210;
+		data->accelerometer.confidence = vals[0] == MC3230_CHIP_ID ?
+			Q8_CONFIDENCE_HIGH : Q8_CONFIDENCE_MEDIUM;
+		return 0;
+	case MC3230_PRODUCT_CODE:
+		data->accelerometer.compatible =
+			accelerometer_compatibles[mc3230];
+		data->accelerometer.model = mc3230;
+		data->accelerometer.confidence = vals[0] == MC3230_CHIP_ID ?
+			Q8_CONFIDENCE_HIGH : Q8_CONFIDENCE_MEDIUM;
+		return 0;
+	default:
+		return -ENODEV;
+	}
+
+	/*
+	 * The mma7660 "id" is 2 reserved registers reading 0, which anything
+	 * returning all zeros matches. Check that the unused bit 7 of the
+	 * x, y and z output registers is 0 too.
+	 */
+	ret = q8_hardwaremgr_read_regs(client, MMA7660_REG_XOUT, vals3,
+				       sizeof(vals3));
+	if (ret == -ETIMEDOUT)
+		return ret;
+
+	if (ret || ((vals3[0] | vals3[1] | vals3[2]) & 0x80))
+		data->accelerometer.confidence = Q8_CONFIDENCE_LOW;
+
+	return 0;
+}
+
+static int __q8_detect q8_hardwaremgr_probe_dmard06(
+	struct q8_hardwaremgr_data *data, struct i2c_client *client)
+{
+	int confidence, id;
+
+	id = q8_hardwaremgr_read_id(client, DMARD06_CHIP_ID_REG,
+				    DMARD06_CHIP_ID_REG, DMARD06_XOUT_REG,
+				    0xff, &confidence);
+	switch (id) {
+	case DMARD05_CHIP_ID:
+		data->accelerometer.compatible =
+			accelerometer_compatibles[dmard05];
+		data->accelerometer.model = dmard05;
+		break;
+	case DMARD06_CHIP_ID:
+		data->accelerometer.compatible =
+			accelerometer_compatibles[dmard06];
+		data->accelerometer.model = dmard06;
+		break;
+	case DMARD07_CHIP_ID:
+		data->accelerometer.compatible =
+			accelerometer_compatibles[dmard07];
+		data->accelerometer.model = dmard07;
+		break;
+	default:
+		return id == -ETIMEDOUT ? -ETIMEDOUT : -ENODEV;
+	}
+
+	data->accelerometer.confidence = confidence;
+	return 0;
+}
+
+static int __q8_detect q8_hardwaremgr_probe_dmard09(
+	struct q8_hardwaremgr_data *data, struct i2c_client *client)
+{
+	int confidence, id;
+
+	id = q8_hardwaremgr_read_id(client, DMARD09_REG_CHIPID,
+				    DMARD09_REG_CHIPID, DMARD09_REG_X,
+				    0xff, &confidence);
+	if (id == DMARD09_CHIPID) {
+		data->accelerometer.compatible =
+			accelerometer_compatibles[dmard09];
+		data->accelerometer.model = dmard09;
+		data->accelerometer.confidence = confidence;
+		return 0;
+	}
+
+	return id == -ETIMEDOUT ? -ETIMEDOUT : -ENODEV;
+}
+
+static int __q8_detect q8_hardwaremgr_probe_dmard10(
+	struct q8_hardwaremgr_data *data, struct i2c_client *client)
+{
+	static const u8 regs[2] = { DMARD10_REG_STADR, DMARD10_REG_STAINT };
+	u8 vals[2];
+	int ret;
+
+	/* These 2 registers have special POR reset values used for id */
+	ret = q8_hardwaremgr_read_reg_list(client, regs, vals, 2);
+	if (ret)
+		return ret == -ETIMEDOUT ? -ETIMEDOUT : -ENODEV;
+
+	if (vals[0] == DMARD10_VALUE_STADR && vals[1] == DMARD10_VALUE_STAINT) {
+		data->accelerometer.compatible =
+			accelerometer_compatibles[dmard10];
+		data->accelerometer.model = dmard10;
+		data->accelerometer.confidence = Q8_CONFIDENCE_HIGH;
+		return 0;
+	}
+
+	return -ENODEV;
+}
+
+static int __q8_detect q8_hardwaremgr_probe_da280(
+	struct q8_hardwaremgr_data *data, struct i2c_client *client)
+{
+	int ret;
+
+	ret = q8_hardwaremgr_read_byte_data(client, DA280_REG_CHIP_ID);
+	if (ret != DA280_CHIP_ID)
+		return ret == -ETIMEDOUT ? -ETIMEDOUT : -ENODEV;
+
+	/* da226 (2-axis) or da280 (3-axis) ? measure once to detect */
+	ret = q8_hardwaremgr_write_byte_data(client, DA280_REG_MODE_BW,
+					     DA280_MODE_ENABLE);
+	if (ret)
+		return ret == -ETIMEDOUT ? -ETIMEDOUT : -ENODEV;
+
+	q8_hardwaremgr_msleep(client->adapter, 10);
+
+	ret = q8_hardwaremgr_read_word_data(client, DA280_REG_ACC_Z_LSB);
+	if (ret < 0)
+		return ret == -ETIMEDOUT ? -ETIMEDOUT : -ENODEV;
+
+	/* Chip id plus a working measurement */
+	data->accelerometer.confidence = Q8_CONFIDENCE_HIGH;
+
+	/* If not present Z reports max pos value (14 bits, 2 low bits 0) */
+	if (ret == 32764) {
+		data->accelerometer.compatible =
+			accelerometer_compatibles[da226];
+		data->accelerometer.model = da226;
+	} else {
+		data->accelerometer.compatible =
+			accelerometer_compatibles[da280];
+		data->accelerometer.model = da280;
+	}
+
+	ret = q8_hardwaremgr_write_byte_data(client, DA280_REG_MODE_BW,
+					     DA280_MODE_DISABLE);
+	if (ret)
+		return ret == -ETIMEDOUT ? -ETIMEDOUT : -ENODEV;
+
+	return 0;
+}
+
+static int __q8_detect q8_hardwaremgr_probe_da311(
+	struct q8_hardwaremgr_data *data, struct i2c_client *client)
+{
+	int confidence, id;
+
+	/* Also read the id through its alias in the wrapped register map */
+	id = q8_hardwaremgr_read_id(client, DA311_REG_CHIP_ID,
+				    DA311_REG_CHIP_ID_ALIAS, DA311_REG_OUT_X_L,
+				    0xff, &confidence);
+	if (id == DA311_CHIP_ID) {
+		data->accelerometer.compatible =
+			accelerometer_compatibles[da311];
+		data->accelerometer.model = da311;
+		data->accelerometer.confidence = confidence;
+		return 0;
+	}
+
+	return id == -ETIMEDOUT ? -ETIMEDOUT : -ENODEV;
+}
+
+static const struct q8_hardwaremgr_candidate accelerometer_candidates[] __q8_detectconst = {
+	{ 0x15, q8_hardwaremgr_probe_mxc6225 },
+	{ 0x4c, q8_hardwaremgr_probe_mc3230 },
+	{ 0x1c, q8_hardwaremgr_probe_dmard06 },
+	{ 0x1d, q8_hardwaremgr_probe_dmard09 },
+	{ 0x18, q8_hardwaremgr_probe_dmard10 },
+	{ 0x26, q8_hardwaremgr_probe_da280, true },
+	{ 0x27, q8_hardwaremgr_probe_da280, true },
+	{ 0x27, q8_hardwaremgr_probe_da311 },
+};
+
+static unsigned int accelerometer_hits[ARRAY_SIZE(accelerometer_candidates)];
+module_param_array(accelerometer_hits, uint, NULL, 0644);
+MODULE_PARM_DESC(accelerometer_hits, "Accelerometer candidate hit counters, used to order probing");
+
+static struct q8_hardwaremgr_bus_stats
+	accelerometer_stats[ARRAY_SIZE(accelerometer_candidates)];
+
+/*
+ * The hit counters can also come from a firmware file, e.g. a fleet-wide
+ * ordering or counters saved by userspace at shutdown. It holds the
+ * touchscreen and then the accelerometer counters as little endian u32s,
+ * in candidate table order. It is only used when no counters were passed
+ * as module params.
+ */
+#define Q8_HARDWAREMGR_HITS_FW		"q8-hwmgr-hits.bin"
+#define Q8_HARDWAREMGR_HITS_COUNT	(ARRAY_SIZE(touchscreen_hits) + \
+					 ARRAY_SIZE(accelerometer_hits))
+
+static void __q8_detect q8_hardwaremgr_load_hits(struct device *dev)
+{
+	const struct firmware *fw;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(touchscreen_hits); i++)
+		if (touchscreen_hits[i])
+			return;
+	for (i = 0; i < ARRAY_SIZE(accelerometer_hits); i++)
+		if (accelerometer_hits[i])
+			return;
+
+	/* No usermode helper fallback, this must not stall probing */
+	if (request_firmware_direct(&fw, Q8_HARDWAREMGR_HITS_FW, dev))
+		return;
+
+	if (fw->size != Q8_HARDWAREMGR_HITS_COUNT * 4) {
+		dev_warn(dev, "Ignoring %s with size %zu, expected %zu\n",
+			 Q8_HARDWAREMGR_HITS_FW, fw->size,
+			 Q8_HARDWAREMGR_HITS_COUNT * 4);
+		goto out;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(touchscreen_hits); i++)
+		touchscreen_hits[i] = get_unaligned_le32(fw->data + i * 4);
+	for (i = 0; i < ARRAY_SIZE(accelerometer_hits); i++)
+		accelerometer_hits[i] = get_unaligned_le32(fw->data +
+				(ARRAY_SIZE(touchscreen_hits) + i) * 4);
+
+	q8_hardwaremgr_log(dev_info, dev, "Using hit counters from %s\n",
+			   Q8_HARDWAREMGR_HITS_FW);
+out:
+	release_firmware(fw);
+}
+
+static int __q8_detect q8_hardwaremgr_probe_accelerometer(
+	struct q8_hardwaremgr_data *data, struct i2c_adapter *adap)
+{
+	unsigned int *hits = !adap ?
+				q8_hardwaremgr_replay_state.accelerometer_hits :
+				data->accelerometer_hits ?: accelerometer_hits;
+	int ret;
+
+	/*
+	 * The rda599x wifi/bt/fm shares the i2c bus with the accelerometer,
+	 * it is always checked first since the touchscreen heuristics and
+	 * quirks need to know about it regardless of which accelerometer
+	 * gets found.
+	 */
+	q8_hardwaremgr_lock_bus(adap);
+
+	ret = q8_hardwaremgr_probe_client(data, NULL, adap, 0x11,
+					  q8_hardwaremgr_probe_rda599x);
+	if (ret == -ENODEV)
+		ret = q8_hardwaremgr_probe_candidates(data,
+					&data->accelerometer, adap,
+					accelerometer_candidates, hits,
+					adap ? accelerometer_stats : NULL,
+					ARRAY_SIZE(accelerometer_candidates));
+
+	q8_hardwaremgr_unlock_bus(adap);
+
+	return ret;
+}
+
+static void __q8_detect q8_hardwaremgr_apply_accelerometer(
+	struct q8_hardwaremgr_data *data)
+{
+	struct of_changeset *cset = &data->accelerometer.cset;
+	struct device_node *np;
+
+	if (data->accelerometer.model == accel_unknown)
+		return;
+
+	np = q8_hardware_mgr_apply_common(&data->accelerometer, cset,
+					  "accelerometer");
+	if (!np)
+		return;
+
+	q8_hardwaremgr_track_node(data, &data->accelerometer_np, np);
+
+	q8_hardwaremgr_commit_cset(data, cset, &data->accelerometer.applied);
+	of_node_put(np);
+}
+
+static void __q8_detect q8_hardwaremgr_apply_quirks(
+	struct q8_hardwaremgr_data *data)
+{
+	struct of_changeset *cset = &data->quirks_cset;
+	struct device_node *np;
+
+	/* Only set by an A33 rule */
+	if (Q8_HWMGR_BUILD_A33 &&
+	    (data->quirks & Q8_HWMGR_QUIRK_ESP_CRYSTAL_26M)) {
+		q8_hardwaremgr_log(dev_info, data->dev, "Applying crystal_26M_en=1 sdio_wifi quirk\n");
+		np = of_find_node_by_name(of_root, "sdio_wifi");
+		if (!np) {
+			dev_warn(data->dev, "Could not find sdio_wifi dt node\n");
+			return;
+		}
+		of_changeset_init(cset);
+		of_changeset_add_property_u32(cset, np,
+					      "esp,crystal-26M-en", 1);
+		q8_hardwaremgr_commit_cset(data, cset, &data->quirks_applied);
+		of_node_put(np);
+	}
+}
+
+/* Start a new capture log, recording the candidate ordering input */
+static void __q8_detect q8_hardwaremgr_capture_start(void)
+{
+	struct q8_hardwaremgr_capture *log = &q8_hardwaremgr_capture_log;
+	__le32 hits[ARRAY_SIZE(touchscreen_hits) +
+		    ARRAY_SIZE(accelerometer_hits)];
+	unsigned long irqflags;
+	int i, n = 0;
+
+	if (capture && !log->buf)
+		log->buf = kmalloc(Q8_HARDWAREMGR_CAPTURE_SIZE, GFP_KERNEL);
+
+	spin_lock_irqsave(&q8_hardwaremgr_capture_lock, irqflags);
+	log->active = capture && log->buf;
+	log->len = 0;
+	log->truncated = false;
+	log->start_ns = ktime_get_ns();
+	q8_hardwaremgr_capture_blob.data = log->buf;
+	q8_hardwaremgr_capture_blob.size = 0;
+	spin_unlock_irqrestore(&q8_hardwaremgr_capture_lock, irqflags);
+
+	for (i = 0; i < ARRAY_SIZE(touchscreen_hits); i++)
+		hits[n++] = cpu_to_le32(touchscreen_hits[i]);
+	for (i = 0; i < ARRAY_SIZE(accelerometer_hits); i++)
+		hits[n++] = cpu_to_le32(accelerometer_hits[i]);
+
+	q8_hardwaremgr_capture(Q8_HWMGR_REC_CONFIG, NULL, 0, prescan, 0,
+			       hits, sizeof(hits));
+}
+
+/*
+ * Shadow mode, for validating probe engine changes on the fleet before
+ * relying on them: the legacy engine, which probes the candidates one by
+ * one in table order, is authoritative. The current engine (prescan and
+ * hit ordering) runs on scratch data right after it, in the same power
+ * window, and once detection is done the results and latencies of both
+ * get compared.
+ */
+static bool shadow;
+module_param(shadow, bool, 0644);
+MODULE_PARM_DESC(shadow, "Detect with the legacy engine, compare against the current one");
+
+/*
+ * Scratch data for probing without touching the real results. It orders
+ * candidates by a private copy of the hit counters, so that its hits do not
+ * skew the ordering. Free with kfree(), data is the first member.
+ */
+struct q8_hardwaremgr_scratch {
+	struct q8_hardwaremgr_data data;
+	unsigned int touchscreen_hits[ARRAY_SIZE(touchscreen_candidates)];
+	unsigned int accelerometer_hits[ARRAY_SIZE(accelerometer_candidates)];
+};
+
+static struct q8_hardwaremgr_data __q8_detect *q8_hardwaremgr_scratch_alloc(
+	struct q8_hardwaremgr_data *data)
+{
+	struct q8_hardwaremgr_scratch *s;
+
+	s = kzalloc(sizeof(*s), GFP_KERNEL);
+	if (!s)
+		return NULL;
+
+	memcpy(s->touchscreen_hits, touchscreen_hits,
+	       sizeof(s->touchscreen_hits));
+	memcpy(s->accelerometer_hits, accelerometer_hits,
+	       sizeof(s->accelerometer_hits));
+	s->data.touchscreen_hits = s->touchscreen_hits;
+	s->data.accelerometer_hits = s->accelerometer_hits;
+	s->data.dev = data->dev;
+	s->data.soc = data->soc;
+	s->data.powered = data->powered;
+
+	return &s->data;
+}
+
+/* Drop the shadow results, on errors shadow_finish() does not get called */
+static void q8_hardwaremgr_shadow_discard(struct q8_hardwaremgr_data *data)
+{
+	kfree(data->shadow);
+	data->shadow = NULL;
+}
+
+static void __q8_detect q8_hardwaremgr_shadow_start(
+	struct q8_hardwaremgr_data *data)
+{
+	q8_hardwaremgr_shadow_discard(data);
+	data->legacy_engine = shadow;
+	memset(data->engine_ns, 0, sizeof(data->engine_ns));
+
+	if (shadow)
+		data->shadow = q8_hardwaremgr_scratch_alloc(data);
+}
+
+static void __q8_detect q8_hardwaremgr_shadow_finish(
+	struct q8_hardwaremgr_data *data)
+{
+	struct q8_hardwaremgr_data *s = data->shadow;
+	const struct q8_hardwaremgr_ts_rule *rule, *shadow_rule;
+	int ts_count = ARRAY_SIZE(touchscreen_model_names);
+	int accel_count = ARRAY_SIZE(accelerometer_model_names);
+	bool agree;
+
+	if (!s)
+		return;
+
+	rule = q8_hardwaremgr_find_ts_rule(data);
+	shadow_rule = q8_hardwaremgr_find_ts_rule(s);
+
+	agree = s->touchscreen.model == data->touchscreen.model &&
+		s->touchscreen.addr == data->touchscreen.addr &&
+		s->accelerometer.model == data->accelerometer.model &&
+		s->accelerometer.addr == data->accelerometer.addr &&
+		s->has_rda599x == data->has_rda599x &&
+		q8_hardwaremgr_ts_rule_equivalent(shadow_rule, rule);
+
+	snprintf(data->shadow_report, sizeof(data->shadow_report),
+		 "%s touchscreen %s@0x%02x/%s@0x%02x variant %d/%d accelerometer %s@0x%02x/%s@0x%02x rda599x %d/%d legacy %llu/%llu us new %llu/%llu us\n",
+		 agree ? "agree" : "DISAGREE",
+		 q8_hardwaremgr_model_name(touchscreen_model_names, ts_count,
+					   data->touchscreen.model),
+		 data->touchscreen.addr,
+		 q8_hardwaremgr_model_name(touchscreen_model_names, ts_count,
+					   s->touchscreen.model),
+		 s->touchscreen.addr,
+		 rule ? rule->variant : 0, shadow_rule ? shadow_rule->variant : 0,
+		 q8_hardwaremgr_model_name(accelerometer_model_names,
+					   accel_count,
+					   data->accelerometer.model),
+		 data->accelerometer.addr,
+		 q8_hardwaremgr_model_name(accelerometer_model_names,
+					   accel_count, s->accelerometer.model),
+		 s->accelerometer.addr,
+		 data->has_rda599x, s->has_rda599x,
+		 div_u64(data->engine_ns[1][0], NSEC_PER_USEC),
+		 div_u64(data->engine_ns[1][1], NSEC_PER_USEC),
+		 div_u64(data->engine_ns[0][0], NSEC_PER_USEC),
+		 div_u64(data->engine_ns[0][1], NSEC_PER_USEC));
+
+	if (agree)
+		q8_hardwaremgr_log(dev_info, data->dev, "shadow: %s",
+				   data->shadow_report);
+	else
+		dev_warn(data->dev, "shadow: %s", data->shadow_report);
+
+	q8_hardwaremgr_shadow_discard(data);
+}
+
+static int __q8_detect q8_hardwaremgr_engine_probe(
+	struct q8_hardwaremgr_data *data, struct q8_hardwaremgr_device *dev,
+	struct i2c_adapter *adap, bus_probe_func func, u64 *ns)
+{
+	u64 start = ktime_get_ns();
+	int ret;
+
+	q8_hardwaremgr_capture(Q8_HWMGR_REC_PROBE, adap, 0,
+			       (data->legacy_engine ? Q8_HWMGR_REC_LEGACY : 0) |
+			       (data->powered ? Q8_HWMGR_REC_POWERED : 0),
+			       dev == &data->accelerometer, NULL, 0);
+	ret = func(data, adap);
+	q8_hardwaremgr_capture(Q8_HWMGR_REC_DONE, adap, dev->addr, dev->model,
+			       ret, NULL, 0);
+
+	*ns += ktime_get_ns() - start;
+	return ret;
+}
+
+static int __q8_detect q8_hardwaremgr_bus_probe(
+	struct q8_hardwaremgr_data *data, struct q8_hardwaremgr_device *dev,
+	struct i2c_adapter *adap, bus_probe_func func)
+{
+	struct q8_hardwaremgr_data *s = data->shadow;
+	int accel = dev == &data->accelerometer;
+	struct q8_hardwaremgr_bus_stats snap;
+	int ret;
+
+	/* The probe functions need plain i2c transfers, not just smbus */
+	if (adap && !i2c_check_functionality(adap, I2C_FUNC_I2C)) {
+		dev_warn(data->dev, "i2c-%d does not support i2c transfers\n",
+			 adap->nr);
+		return -ENODEV;
+	}
+
+	q8_hardwaremgr_stats_begin(adap, &snap);
+	ret = q8_hardwaremgr_engine_probe(data, dev, adap, func,
+				&data->engine_ns[data->legacy_engine][accel]);
+	q8_hardwaremgr_stats_end(adap, &snap,
+				 &q8_hardwaremgr_pass_stats[accel]);
+
+	/* The shadow result is informational only, ignore errors */
+	if (s)
+		q8_hardwaremgr_engine_probe(s,
+				accel ? &s->accelerometer : &s->touchscreen,
+				adap, func, &data->engine_ns[0][accel]);
+
+	return ret;
+}
+
+static void __q8_detect q8_hardwaremgr_stats_reset(void)
+{
+	spin_lock(&q8_hardwaremgr_stats_lock);
+	memset(q8_hardwaremgr_bus_stats, 0, sizeof(q8_hardwaremgr_bus_stats));
+	q8_hardwaremgr_bus_count = 0;
+	q8_hardwaremgr_bus_dropped = 0;
+	memset(q8_hardwaremgr_pass_stats, 0, sizeof(q8_hardwaremgr_pass_stats));
+	memset(touchscreen_stats, 0, sizeof(touchscreen_stats));
+	memset(accelerometer_stats, 0, sizeof(accelerometer_stats));
+	spin_unlock(&q8_hardwaremgr_stats_lock);
+}
+
+static void q8_hardwaremgr_stats_show_one(struct seq_file *m,
+	const char *name, int index, const struct q8_hardwaremgr_bus_stats *st)
+{
+	u64 other = st->total_ns - min(st->total_ns,
+				       st->sleep_ns + st->wire_ns);
+
+	if (!st->runs)
+		return;
+
+	seq_printf(m, "%s %d: runs %u transfers %u bytes %u total %llu us sleep %llu us wire %llu us other %llu us\n",
+		   name, index, st->runs, st->transfers, st->bytes,
+		   div_u64(st->total_ns, NSEC_PER_USEC),
+		   div_u64(st->sleep_ns, NSEC_PER_USEC),
+		   div_u64(st->wire_ns, NSEC_PER_USEC),
+		   div_u64(other, NSEC_PER_USEC));
+}
+
+static int q8_hardwaremgr_occupancy_show(struct seq_file *m, void *unused)
+{
+	const struct q8_hardwaremgr_bus_stats *st;
+	int i;
+
+	spin_lock(&q8_hardwaremgr_stats_lock);
+
+	for (i = 0; i < q8_hardwaremgr_bus_count; i++) {
+		st = &q8_hardwaremgr_bus_stats[i];
+		if (!st->clock_hz && !st->sleep_ns)
+			continue;
+
+		seq_printf(m, "i2c-%d: clock %u Hz transfers %u bytes %u in transfers %llu us wire %llu us sleep %llu us\n",
+			   st->nr, st->clock_hz, st->transfers, st->bytes,
+			   div_u64(st->xfer_ns, NSEC_PER_USEC),
+			   div_u64(st->wire_ns, NSEC_PER_USEC),
+			   div_u64(st->sleep_ns, NSEC_PER_USEC));
+	}
+
+	if (q8_hardwaremgr_bus_dropped)
+		seq_printf(m, "other buses: %u transfers not accounted\n",
+			   q8_hardwaremgr_bus_dropped);
+
+	q8_hardwaremgr_stats_show_one(m, "touchscreen-pass", 0,
+				      &q8_hardwaremgr_pass_stats[0]);
+	q8_hardwaremgr_stats_show_one(m, "accelerometer-pass", 0,
+				      &q8_hardwaremgr_pass_stats[1]);
+
+	for (i = 0; i < ARRAY_SIZE(touchscreen_stats); i++)
+		q8_hardwaremgr_stats_show_one(m, "touchscreen-candidate", i,
+					      &touchscreen_stats[i]);
+	for (i = 0; i < ARRAY_SIZE(accelerometer_stats); i++)
+		q8_hardwaremgr_stats_show_one(m, "accelerometer-candidate", i,
+					      &accelerometer_stats[i]);
+
+	spin_unlock(&q8_hardwaremgr_stats_lock);
+
+	return 0;
+}
+
+static int q8_hardwaremgr_occupancy_open(struct inode *inode,
+					 struct file *file)
+{
+	return single_open(file, q8_hardwaremgr_occupancy_show, NULL);
+}
+
+static const struct file_operations q8_hardwaremgr_occupancy_fops = {
+	.owner		= THIS_MODULE,
+	.open		= q8_hardwaremgr_occupancy_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/*
+ * Some batches route the touchscreen or accelerometer to another i2c
+ * controller than the one the template node sits on. With the discover
+ * param set, a device not found on the template's bus gets looked for on
+ * all other devicetree described i2c adapters, one worker per adapter so
+ * that this costs about as much as a single extra bus probe. Each worker
+ * probes into its own scratch data, with its own copy of the hit counters,
+ * the lowest numbered adapter where the device was found wins and the
+ * template node gets reparented to it. The chips on the other adapters are
+ * unknown, so only candidates which identify by reads alone are tried
+ * there, and an rda599x found there does not count, the touchscreen
+ * heuristics are about the one sharing the template's bus.
+ */
+#define Q8_HARDWAREMGR_MAX_ADAPTERS	8
+
+static bool discover;
+module_param(discover, bool, 0644);
+MODULE_PARM_DESC(discover, "Look for devices not found on the template node's bus on all i2c adapters");
+
+struct q8_hardwaremgr_adapters {
+	int nr[Q8_HARDWAREMGR_MAX_ADAPTERS];
+	int count;
+};
+
+struct q8_hardwaremgr_discovery {
+	struct work_struct work;
+	struct q8_hardwaremgr_data *data; /* Scratch data */
+	struct q8_hardwaremgr_device *dev;
+	struct i2c_adapter *adap;
+	bus_probe_func func;
+	int ret;
+};
+
+static int __q8_detect q8_hardwaremgr_collect_adapter(struct device *dev,
+						      void *arg)
+{
+	struct q8_hardwaremgr_adapters *adapters = arg;
+	struct i2c_adapter *adap = i2c_verify_adapter(dev);
+
+	if (!adap || !adap->dev.of_node ||
+	    !i2c_check_functionality(adap, I2C_FUNC_I2C) ||
+	    adapters->count == Q8_HARDWAREMGR_MAX_ADAPTERS)
+		return 0;
+
+	adapters->nr[adapters->count++] = adap->nr;
+	return 0;
+}
+
+static void __q8_detect q8_hardwaremgr_discovery_work(struct work_struct *work)
+{
+	struct q8_hardwaremgr_discovery *d =
+		container_of(work, struct q8_hardwaremgr_discovery, work);
+
+	d->ret = q8_hardwaremgr_bus_probe(d->data, d->dev, d->adap, d->func);
+}
+
+static int __q8_detect q8_hardwaremgr_discover(
+	struct q8_hardwaremgr_data *data, struct q8_hardwaremgr_device *dev,
+	struct i2c_adapter *template_adap, bus_probe_func func)
+{
+	struct q8_hardwaremgr_adapters adapters = { };
+	struct q8_hardwaremgr_discovery *workers;
+	int accel = dev == &data->accelerometer;
+	int i, count = 0, ret = -ENODEV;
+
+	/* Replaying, the capture only has the template's bus */
+	if (!discover || !template_adap)
+		return -ENODEV;
+
+	i2c_for_each_dev(&adapters, q8_hardwaremgr_collect_adapter);
+
+	workers = kcalloc(adapters.count, sizeof(*workers), GFP_KERNEL);
+	if (!workers)
+		return -ENOMEM;
+
+	for (i = 0; i < adapters.count; i++) {
+		struct q8_hardwaremgr_discovery *d = &workers[count];
+
+		if (adapters.nr[i] == template_adap->nr)
+			continue;
+
+		d->adap = i2c_get_adapter(adapters.nr[i]);
+		if (!d->adap)
+			continue;
+
+		d->data = q8_hardwaremgr_scratch_alloc(data);
+		if (!d->data) {
+			i2c_put_adapter(d->adap);
+			continue;
+		}
+
+		d->data->legacy_engine = data->legacy_engine;
+		d->data->read_only = true;
+		d->dev = accel ? &d->data->accelerometer :
+				 &d->data->touchscreen;
+		d->func = func;
+		INIT_WORK(&d->work, q8_hardwaremgr_discovery_work);
+		queue_work(system_unbound_wq, &d->work);
+		count++;
+	}
+
+	/* Workers are in adapter order, so the first hit is the lowest nr */
+	for (i = 0; i < count; i++) {
+		struct q8_hardwaremgr_discovery *d = &workers[i];
+
+		flush_work(&d->work);
+
+		if (d->ret == 0 && ret != 0) {
+			dev->model = d->dev->model;
+			dev->addr = d->dev->addr;
+			dev->confidence = d->dev->confidence;
+			dev->compatible = d->dev->compatible;
+			dev->bus_np = of_node_get(d->adap->dev.of_node);
+			/* Only the hit on the bus which gets used counts */
+			if (accel)
+				memcpy(accelerometer_hits,
+				       d->data->accelerometer_hits,
+				       sizeof(accelerometer_hits));
+			else
+				memcpy(touchscreen_hits,
+				       d->data->touchscreen_hits,
+				       sizeof(touchscreen_hits));
+			q8_hardwaremgr_log(dev_info, data->dev,
+					   "Discovered %s on i2c-%d\n",
+					   dev->compatible, d->adap->nr);
+			ret = 0;
+		} else if (d->ret == 0) {
+			dev_warn(data->dev, "Ignoring %s also found on i2c-%d\n",
+				 d->dev->compatible, d->adap->nr);
+		}
+
+		i2c_put_adapter(d->adap);
+		kfree(d->data);
+	}
+
+	kfree(workers);
+	return ret;
+}
+
+/*
+ * The pinctrl core caches the pinctrl handle per device and all classes
+ * share our device, so drop it again right after selecting the default
+ * state. The pins stay configured.
+ */
+static int __q8_detect q8_hardwaremgr_select_pins(struct device *dev)
+{
+	struct pinctrl_state *state;
+	struct pinctrl *pinctrl;
+	int ret = 0;
+
+	pinctrl = pinctrl_get(dev);
+	if (IS_ERR(pinctrl))
+		return PTR_ERR(pinctrl) == -EPROBE_DEFER ? -EPROBE_DEFER : 0;
+
+	state = pinctrl_lookup_state(pinctrl, PINCTRL_STATE_DEFAULT);
+	if (!IS_ERR(state)) {
+		ret = pinctrl_select_state(pinctrl, state);
+		if (ret != -EPROBE_DEFER)
+			ret = 0;
+	}
+
+	pinctrl_put(pinctrl);
+	return ret;
+}
+
+/* The resources to power up a class' template node's device for probing */
+struct q8_hardwaremgr_power {
+	struct device_node *np;
+	struct i2c_adapter *adap;
+	struct regulator *reg;
+	struct gpio_desc *gpio;
+};
+
+static void __q8_detect q8_hardwaremgr_power_put(
+	struct q8_hardwaremgr_power *pwr)
+{
+	if (pwr->gpio) {
+		gpiod_direction_output(pwr->gpio, 0);
+		gpiod_put(pwr->gpio);
+	}
+	if (pwr->adap)
+		i2c_put_adapter(pwr->adap);
+	if (pwr->reg)
+		regulator_put(pwr->reg);
+	of_node_put(pwr->np);
+}
+
+/* Gets the resources and drives the power gpio (if any) high */
+static int __q8_detect q8_hardwaremgr_power_get(
+	struct q8_hardwaremgr_data *data, const char *prefix,
+	struct q8_hardwaremgr_power *pwr)
+{
+	struct regulator *reg;
+	struct gpio_desc *gpio;
+	int ret;
+
+	memset(pwr, 0, sizeof(*pwr));
+
+	pwr->np = of_find_node_by_name(of_root, prefix);
+	if (!pwr->np) {
+		dev_err(data->dev, "Error %s node is missing\n", prefix);
+		return -EINVAL;
+	}
+
+	/*
+	 * Patch the dt_node into our device since there is no device for
+	 * the probed hw yet (status = disabled). The classes get probed in
+	 * parallel, so this is serialized.
+	 */
+	mutex_lock(&data->of_node_lock);
+	data->dev->of_node = pwr->np;
+
+	ret = q8_hardwaremgr_select_pins(data->dev);
+	if (ret == 0) {
+		reg = regulator_get_optional(data->dev, "vddio");
+		if (IS_ERR(reg)) {
+			ret = PTR_ERR(reg);
+			if (ret != -EPROBE_DEFER)
+				ret = 0;
+		} else {
+			pwr->reg = reg;
+		}
+	}
+
+	data->dev->of_node = NULL;
+	mutex_unlock(&data->of_node_lock);
+	if (ret)
+		goto error;
+
+	pwr->adap = of_get_i2c_adapter_by_node(pwr->np->parent);
+	if (!pwr->adap) {
+		ret = -EPROBE_DEFER;
+		goto error;
+	}
+
+	gpio = fwnode_get_named_gpiod(&pwr->np->fwnode, "power-gpios");
+	if (IS_ERR(gpio)) {
+		ret = PTR_ERR(gpio);
+		if (ret == -EPROBE_DEFER)
+			goto error;
+		gpio = NULL;
+	}
+
+	if (gpio) {
+		ret = gpiod_direction_output(gpio, 1);
+		if (ret) {
+			gpiod_put(gpio);
+			goto error;
+		}
+		pwr->gpio = gpio;
+	}
+
+	return 0;
+
+error:
+	q8_hardwaremgr_power_put(pwr);
+	return ret;
+}
+
+/*
+ * With @powered the class' resources have already been powered up by
+ * q8_hardwaremgr_power_up() and the bus gets probed only once.
+ */
+static int __q8_detect q8_hardwaremgr_do_probe(struct q8_hardwaremgr_data *data,
+					       struct q8_hardwaremgr_device *dev,
+					       const char *prefix,
+					       bus_probe_func func,
+					       struct q8_hardwaremgr_power *powered)
+{
+	struct q8_hardwaremgr_power own, *pwr = powered;
+	struct i2c_adapter *adap;
+	struct regulator *reg;
+	int ret;
+
+	if (!pwr) {
+		pwr = &own;
+		ret = q8_hardwaremgr_power_get(data, prefix, pwr);
+		if (ret)
+			return ret;
+	}
+
+	adap = pwr->adap;
+	reg = pwr->reg;
+
+	if (powered) {
+		ret = q8_hardwaremgr_bus_probe(data, dev, adap, func);
+		if (ret == -ENODEV)
+			ret = q8_hardwaremgr_discover(data, dev, adap, func);
+		/* There was no try without it, keep the regulator */
+		if (ret == 0 && reg)
+			dev->needs_regulator = true;
+		goto found;
+	}
+
+	/* First try with only the power gpio driven high */
+	q8_hardwaremgr_log(dev_info, data->dev, "Probing %s without a regulator\n",
+			   prefix);
+	ret = q8_hardwaremgr_bus_probe(data, dev, adap, func);
+	if (ret != 0 && reg) {
+		/* Second try, also enable the regulator */
+		ret = regulator_enable(reg);
+		if (ret)
+			goto put;
+
+		q8_hardwaremgr_log(dev_info, data->dev, "Probing %s with a regulator\n",
+				   prefix);
+		ret = q8_hardwaremgr_bus_probe(data, dev, adap, func);
+		if (ret == -ENODEV)
+			ret = q8_hardwaremgr_discover(data, dev, adap, func);
+		if (ret == 0)
+			dev->needs_regulator = true;
+
+/* 4.9 silead driver lacks regulator support, leave it enabled */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 10, 0)
+		regulator_disable(reg);
+#endif
+	} else if (reg)
+		dev->delete_regulator = true; /* Regulator not needed */
+	else if (ret == -ENODEV)
+		ret = q8_hardwaremgr_discover(data, dev, adap, func);
+
+found:
+	if (ret == 0)
+		q8_hardwaremgr_log(dev_info, data->dev, "Found %s at 0x%02x, confidence %d\n",
+				   dev->compatible, dev->addr, dev->confidence);
+	else
+		ret = 0; /* Not finding a device is not an error */
+
+put:
+	if (!powered)
+		q8_hardwaremgr_power_put(pwr);
+
+	return ret;
+}
+
+/*
+ * sun5i-a13-q8-tablet.dts on kernel 4.8 is missing the touchscreen
+ * template node, add it.
+ */
+static int __q8_detect q8_hardwaremgr_add_touchscreen_node(
+	struct q8_hardwaremgr_data *data)
+{
+	/* FIXME */
+	return 0;
+}
+
+/*
+ * Originally the q8-hwmgr design was for the dt to already have a template
+ * touchscreen node on the right i2c bus, but since q8-hwmgr is not (yet?)
+ * upstream that node may be missing or incomplete
+ */
+static int __q8_detect q8_hardwaremgr_fixup_touchscreen_node(
+	struct q8_hardwaremgr_data *data)
+{
+	struct device_node *ts_np, *reg_np = NULL;
+	struct property *prop;
+	struct of_changeset cset;
+	struct regulator *reg;
+	int ret = 0;
+
+	if (q8_hardwaremgr_soc(data) == a13)
+		return q8_hardwaremgr_add_touchscreen_node(data);
+
+	ts_np = of_find_node_by_name(of_root, "touchscreen");
+	reg_np = of_find_node_by_name(of_root, "ldo_io1");
+	if (!ts_np || !reg_np) {
+		dev_err(data->dev,
+			"Error dt-nodes missing touchscreen %p, ldo_io1 %p\n",
+			ts_np, reg_np);
+		ret = -EINVAL;
+		goto out_put_np;
+	}
+
+	reg = regulator_get_optional(NULL, "ldo_io1");
+	if (IS_ERR(reg) && PTR_ERR(reg) == -ENODEV)
+		reg = regulator_get_optional(NULL, "vcc-touchscreen");
+	if (IS_ERR(reg)) {
+		ret = PTR_ERR(reg);
+		if (ret != -EPROBE_DEFER)
+			dev_err(data->dev, "Error could not get ldo_io1 regulator %d\n",
+				ret);
+		goto out_put_np;
+	}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 10, 0)
+	if (!reg->rdev->dev.of_node) {
+		reg->rdev->dev.of_node = reg_np;
+	} else if (reg->rdev->dev.of_node != reg_np) {
+		dev_err(data->dev, "Error ldo_io1 dt-node mismatch\n");
+		goto out_put_reg;
+	}
+
+	/* See if the constraints are already set */
+	prop = of_find_property(reg_np, "regulator-min-microvolt", NULL);
+	if (prop)
+		goto add_touchscreen_supply_prop;
+
+	of_changeset_init(&cset);
+	of_changeset_add_property_u32(&cset, reg_np, "regulator-min-microvolt",
+				      3300000);
+	of_changeset_add_property_u32(&cset, reg_np, "regulator-max-microvolt",
+				      3300000);
+	of_changeset_update_property_string(&cset, reg_np, "regulator-name", "vcc-touchscreen");
+	of_changeset_update_property_string(&cset, reg_np, "status", "okay");
+	of_changeset_apply(&cset);
+	of_changeset_destroy(&cset);
+
+	/*
+	 * HACK HACK HACK update the constraints after the regulator core
+	 * has already set them from the incomplete dt.
+	 */
+	reg->rdev->constraints->min_uV = 3300000;
+	reg->rdev->constraints->max_uV = 3300000;
+	reg->rdev->constraints->name = kstrdup("vcc-touchscreen", GFP_KERNEL);
+	reg->rdev->constraints->valid_ops_mask |=
+		REGULATOR_CHANGE_VOLTAGE | REGULATOR_CHANGE_STATUS;
+
+	ret = regulator_set_voltage(reg, 3300000, 3300000);
+	if (ret) {
+		dev_err(data->dev, "Error setting ldo_io1 voltage %d\n", ret);
+		goto out_put_reg;
+	}
+
+add_touchscreen_supply_prop:
+#endif
+	/* See if the supply are already set */
+	prop = of_find_property(ts_np, "vddio-supply", NULL);
+	if (prop)
+		goto out_put_reg;
+
+	/* The reg_np may not have a phandle */
+	if (!reg_np->phandle)
+		reg_np->phandle = of_gen_phandle();
+
+	of_changeset_init(&cset);
+	/* The regulator phandle has no args */
+	of_changeset_add_property_u32(&cset, ts_np, "vddio-supply",
+				      reg_np->phandle);
+	of_changeset_apply(&cset);
+	of_changeset_destroy(&cset);
+
+out_put_reg:
+	regulator_put(reg);
+out_put_np:
+	of_node_put(reg_np);
+	of_node_put(ts_np);
+	return ret;
+}
+
+/*
+ * Originally the q8-hwmgr design was for the dt to already have an empty
+ * accel node on the right i2c bus, but since q8-hwmgr is not (yet?) upstream
+ * that node may be missing.
+ */
+static int __q8_detect q8_hardwaremgr_add_accel_node(
+	struct q8_hardwaremgr_data *data)
+{
+	struct device_node *np, *parent;
+	struct of_changeset cset;
+	int ret = 0;
+
+	np = of_find_node_by_name(of_root, "accelerometer");
+	if (np) {
+		of_node_put(np);
+		return 0; /* accelerometer node already exists */
+	}
+
+	parent = of_find_node_by_path("/soc@01c00000/i2c@01c2b000");
+	if (!parent) {
+		dev_err(data->dev, "Error i2c1 node is missing\n");
+		return -EINVAL;
+	}
+
+	of_changeset_init(&cset);
+	np = of_changeset_create_device_node(&cset, parent, "accelerometer");
+	if (IS_ERR(np)) {
+		ret = PTR_ERR(np);
+		goto out;
+	}
+	of_changeset_add_property_string(&cset, np, "name", "accelerometer");
+	of_changeset_add_property_string(&cset, np, "status", "disabled");
+	of_changeset_attach_node(&cset, np);
+	of_changeset_apply(&cset);
+out:
+	of_changeset_destroy(&cset);
+	of_node_put(parent);
+	return ret;
+}
+
+/*
+ * Compact binary hardware profile, for caching the detection result (e.g.
+ * on the kernel commandline, in a nvmem cell or a tiny firmware file) and
+ * for fleet inventory. All multi-byte fields are little endian, models are
+ * indices into the model name tables, so new models must be appended and
+ * any other change to the layout or the tables needs a version bump. The
+ * fingerprint is the 64 bit FNV-1a hash of the bytes preceding it.
+ * There is no field for the bus, devices found through discovery on
+ * another bus than the template node's can not be stored in a profile.
+ */
+#define Q8_HWMGR_PROFILE_VERSION	1
+
+/* Per device flags */
+#define Q8_HWMGR_PROF_NEEDS_REGULATOR	BIT(0)
+#define Q8_HWMGR_PROF_DELETE_REGULATOR	BIT(1)
+
+/* Profile flags */
+#define Q8_HWMGR_PROF_INVERT_X		BIT(0)
+#define Q8_HWMGR_PROF_INVERT_Y		BIT(1)
+#define Q8_HWMGR_PROF_SWAP_X_Y		BIT(2)
+#define Q8_HWMGR_PROF_RDA599X		BIT(3)
+
+struct q8_hardwaremgr_profile_rec {
+	u8 version;
+	u8 soc;
+	u8 touchscreen_model;
+	u8 touchscreen_addr;
+	u8 touchscreen_flags;
+	u8 accelerometer_model;
+	u8 accelerometer_addr;
+	u8 accelerometer_flags;
+	u8 touchscreen_variant;
+	u8 flags;
+	__le16 touchscreen_width;
+	__le16 touchscreen_height;
+	__le64 fingerprint;
+} __packed;
+
+static char *q8_hardwaremgr_profile_param;
+module_param_named(profile, q8_hardwaremgr_profile_param, charp, 0444);
+MODULE_PARM_DESC(profile, "Hex encoded hardware profile to use instead of probing");
+
+static u64 q8_hardwaremgr_fingerprint(
+	const struct q8_hardwaremgr_profile_rec *rec)
+{
+	const u8 *p = (const u8 *)rec;
+	u64 hash = 0xcbf29ce484222325ULL;
+	int i;
+
+	for (i = 0; i < offsetof(struct q8_hardwaremgr_profile_rec, fingerprint);
+	     i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+static u8 q8_hardwaremgr_device_flags(struct q8_hardwaremgr_device *dev)
+{
+	return (dev->needs_regulator ? Q8_HWMGR_PROF_NEEDS_REGULATOR : 0) |
+	       (dev->delete_regulator ? Q8_HWMGR_PROF_DELETE_REGULATOR : 0);
+}
+
+static void q8_hardwaremgr_pack_profile(struct q8_hardwaremgr_data *data,
+					struct q8_hardwaremgr_profile_rec *rec)
+{
+	memset(rec, 0, sizeof(*rec));
+	rec->version = Q8_HWMGR_PROFILE_VERSION;
+	rec->soc = data->soc;
+	rec->touchscreen_model = data->touchscreen.model;
+	rec->touchscreen_addr = data->touchscreen.addr;
+	rec->touchscreen_flags = q8_hardwaremgr_device_flags(&data->touchscreen);
+	rec->accelerometer_model = data->accelerometer.model;
+	rec->accelerometer_addr = data->accelerometer.addr;
+	rec->accelerometer_flags =
+		q8_hardwaremgr_device_flags(&data->accelerometer);
+	rec->touchscreen_variant = data->touchscreen_variant;
+	rec->flags =
+		(data->touchscreen_invert_x ? Q8_HWMGR_PROF_INVERT_X : 0) |
+		(data->touchscreen_invert_y ? Q8_HWMGR_PROF_INVERT_Y : 0) |
+		(data->touchscreen_swap_x_y ? Q8_HWMGR_PROF_SWAP_X_Y : 0) |
+		(data->has_rda599x ? Q8_HWMGR_PROF_RDA599X : 0);
+	rec->touchscreen_width = cpu_to_le16(data->touchscreen_width);
+	rec->touchscreen_height = cpu_to_le16(data->touchscreen_height);
+	rec->fingerprint = cpu_to_le64(q8_hardwaremgr_fingerprint(rec));
+}
+
+static ssize_t profile_show(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+	struct q8_hardwaremgr_data *data = dev_get_drvdata(dev);
+	struct q8_hardwaremgr_profile_rec rec;
+	bool discovered;
+
+	mutex_lock(&data->lock);
+	q8_hardwaremgr_pack_profile(data, &rec);
+	discovered = data->touchscreen.bus_np || data->accelerometer.bus_np;
+	mutex_unlock(&data->lock);
+
+	if (discovered)
+		return -EOPNOTSUPP;
+
+	return sprintf(buf, "%*phN\n", (int)sizeof(rec), &rec);
+}
+static DEVICE_ATTR_RO(profile);
+
+/* Check what q8_hardwaremgr_do_probe() would have checked */
+static bool __q8_detect q8_hardwaremgr_profile_device_valid(
+	const char *prefix, int count, u8 model, u8 addr, u8 flags)
+{
+	struct device_node *np;
+	bool has_supply;
+
+	if (model >= count || addr >= Q8_HARDWAREMGR_ADDR_COUNT)
+		return false;
+
+	if (model == 0)
+		return true;
+
+	np = of_find_node_by_name(of_root, prefix);
+	if (!np)
+		return false;
+
+	has_supply = of_find_property(np, "vddio-supply", NULL);
+	of_node_put(np);
+
+	return has_supply || !(flags & Q8_HWMGR_PROF_DELETE_REGULATOR);
+}
+
+static void __q8_detect q8_hardwaremgr_load_device(
+	struct q8_hardwaremgr_device *dev, const char * const *compatibles,
+	u8 model, u8 addr, u8 flags)
+{
+	dev->model = model;
+	dev->addr = addr;
+	dev->confidence = model ? Q8_CONFIDENCE_HIGH : 0;
+	dev->compatible = compatibles[model];
+	dev->needs_regulator = flags & Q8_HWMGR_PROF_NEEDS_REGULATOR;
+	dev->delete_regulator = flags & Q8_HWMGR_PROF_DELETE_REGULATOR;
+}
+
+/*
+ * Only the detection results get loaded, the touchscreen variant and
+ * settings get derived from them and the module params as usual.
+ */
+static int __q8_detect q8_hardwaremgr_load_profile(
+	struct q8_hardwaremgr_data *data, const char *hex)
+{
+	struct q8_hardwaremgr_profile_rec rec;
+
+	if (strlen(hex) != 2 * sizeof(rec) ||
+	    hex2bin((u8 *)&rec, hex, sizeof(rec)))
+		return -EINVAL;
+
+	if (rec.version != Q8_HWMGR_PROFILE_VERSION ||
+	    le64_to_cpu(rec.fingerprint) != q8_hardwaremgr_fingerprint(&rec))
+		return -EINVAL;
+
+	if (rec.soc != data->soc)
+		return -ENODEV;
+
+	if (!q8_hardwaremgr_profile_device_valid("touchscreen",
+				ARRAY_SIZE(touchscreen_model_names),
+				rec.touchscreen_model, rec.touchscreen_addr,
+				rec.touchscreen_flags) ||
+	    !q8_hardwaremgr_profile_device_valid("accelerometer",
+				ARRAY_SIZE(accelerometer_model_names),
+				rec.accelerometer_model, rec.accelerometer_addr,
+				rec.accelerometer_flags))
+		return -EINVAL;
+
+	q8_hardwaremgr_load_device(&data->touchscreen, touchscreen_compatibles,
+				   rec.touchscreen_model, rec.touchscreen_addr,
+				   rec.touchscreen_flags);
+	q8_hardwaremgr_load_device(&data->accelerometer,
+				   accelerometer_compatibles,
+				   rec.accelerometer_model,
+				   rec.accelerometer_addr,
+				   rec.accelerometer_flags);
+	data->has_rda599x = rec.flags & Q8_HWMGR_PROF_RDA599X;
+
+	return 0;
+}
+
+/*
+ * The peripheral classes which get detected. Each class has a template
+ * node, which is disabled in the dt and describes the bus (its parent) and
+ * the power resources (pinctrl, power-gpios and vddio-supply), a bus probe
+ * function trying the class' candidates and an apply function filling in
+ * the template. The rda599x lives on the accelerometer's bus and gets
+ * checked by its bus probe function, see q8_hardwaremgr_probe_accelerometer.
+ */
+struct q8_hardwaremgr_class {
+	const char *name;
+	size_t offset; /* Of the class' q8_hardwaremgr_device in our data */
+	bus_probe_func probe;
+	void (*apply)(struct q8_hardwaremgr_data *data);
+};
+
+static const struct q8_hardwaremgr_class q8_hardwaremgr_classes[] __q8_detectconst = {
+	{
+		.name = "touchscreen",
+		.offset = offsetof(struct q8_hardwaremgr_data, touchscreen),
+		.probe = q8_hardwaremgr_probe_touchscreen,
+		.apply = q8_hardwaremgr_apply_touchscreen,
+	}, {
+		.name = "accelerometer",
+		.offset = offsetof(struct q8_hardwaremgr_data, accelerometer),
+		.probe = q8_hardwaremgr_probe_accelerometer,
+		.apply = q8_hardwaremgr_apply_accelerometer,
+	},
+};
+
+struct q8_hardwaremgr_class_work {
+	struct work_struct work;
+	struct q8_hardwaremgr_data *data;
+	const struct q8_hardwaremgr_class *class;
+	struct q8_hardwaremgr_power *pwr; /* NULL unless powered up front */
+	int ret;
+};
+
+static void __q8_detect q8_hardwaremgr_class_probe(struct work_struct *work)
+{
+	struct q8_hardwaremgr_class_work *w =
+		container_of(work, struct q8_hardwaremgr_class_work, work);
+	struct q8_hardwaremgr_device *dev = (void *)w->data + w->class->offset;
+
+	w->ret = q8_hardwaremgr_do_probe(w->data, dev, w->class->name,
+					 w->class->probe, w->pwr);
+}
+
+/*
+ * With the upfront_power param set all classes' power resources get
+ * enabled before any probing, so that their power-on ramps overlap and the
+ * power-on delay is waited for only once, instead of once per class and
+ * regulator retry. The downside is that it can not be determined whether
+ * a chip needs its vddio-supply, so it is always kept.
+ */
+static bool upfront_power;
+module_param(upfront_power, bool, 0644);
+MODULE_PARM_DESC(upfront_power, "Power up all devices at once before probing");
+
+static void __q8_detect q8_hardwaremgr_power_off(
+	struct q8_hardwaremgr_power *pwr)
+{
+/* 4.9 silead driver lacks regulator support, leave it enabled */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 10, 0)
+	if (pwr->reg)
+		regulator_disable(pwr->reg);
+#endif
+	q8_hardwaremgr_power_put(pwr);
+}
+
+static int __q8_detect q8_hardwaremgr_power_up(
+	struct q8_hardwaremgr_data *data, struct q8_hardwaremgr_power *pwr)
+{
+	int i, ret;
+
+	for (i = 0; i < ARRAY_SIZE(q8_hardwaremgr_classes); i++) {
+		ret = q8_hardwaremgr_power_get(data,
+					       q8_hardwaremgr_classes[i].name,
+					       &pwr[i]);
+		if (ret)
+			goto error;
+
+		if (pwr[i].reg) {
+			ret = regulator_enable(pwr[i].reg);
+			if (ret) {
+				q8_hardwaremgr_power_put(&pwr[i]);
+				goto error;
+			}
+		}
+	}
+
+	/* The longest power-on delay of all classes */
+	msleep(TOUCHSCREEN_POWER_ON_DELAY);
+	data->powered = true;
+	return 0;
+
+error:
+	while (i--)
+		q8_hardwaremgr_power_off(&pwr[i]);
+	return ret;
+}
+
+/*
+ * All classes get probed concurrently, each from its own worker, so that
+ * their power-on delays and bus traffic overlap. When capturing they get
+ * probed one after the other, so that the log can be replayed.
+ */
+static int __q8_detect q8_hardwaremgr_detect(struct q8_hardwaremgr_data *data)
+{
+	struct q8_hardwaremgr_class_work works[ARRAY_SIZE(q8_hardwaremgr_classes)];
+	struct q8_hardwaremgr_power pwr[ARRAY_SIZE(q8_hardwaremgr_classes)];
+	bool serial = q8_hardwaremgr_capture_log.active;
+	bool powered = upfront_power;
+	int i, ret = 0;
+
+	if (powered) {
+		ret = q8_hardwaremgr_power_up(data, pwr);
+		if (ret)
+			return ret;
+	}
+
+	q8_hardwaremgr_shadow_start(data);
+
+	for (i = 0; i < ARRAY_SIZE(q8_hardwaremgr_classes); i++) {
+		works[i].data = data;
+		works[i].class = &q8_hardwaremgr_classes[i];
+		works[i].pwr = powered ? &pwr[i] : NULL;
+		INIT_WORK_ONSTACK(&works[i].work, q8_hardwaremgr_class_probe);
+		if (serial)
+			q8_hardwaremgr_class_probe(&works[i].work);
+		else
+			queue_work(system_unbound_wq, &works[i].work);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(q8_hardwaremgr_classes); i++) {
+		flush_work(&works[i].work);
+		destroy_work_on_stack(&works[i].work);
+		if (works[i].ret && !ret)
+			ret = works[i].ret;
+		if (powered)
+			q8_hardwaremgr_power_off(&pwr[i]);
+	}
+	data->powered = false;
+
+	if (ret) {
+		q8_hardwaremgr_shadow_discard(data);
+		return ret;
+	}
+
+	if (data->has_rda599x)
+		q8_hardwaremgr_log(dev_info, data->dev, "Found a rda599x sdio/i2c wifi/bt/fm combo chip\n");
+
+	q8_hardwaremgr_shadow_finish(data);
+	q8_hardwaremgr_mark(data, timing_detected);
+	return 0;
+}
+
+/*
+ * The profile returned by q8_hwmgr_get_profile(), this is a snapshot so that
+ * drivers probing because we apply a changeset can get it without taking
+ * data->lock, which we hold while applying.
+ */
+static struct q8_hwmgr_profile q8_hardwaremgr_profile;
+static bool q8_hardwaremgr_profile_valid;
+static DEFINE_SPINLOCK(q8_hardwaremgr_profile_lock);
+static struct platform_device *q8_hardwaremgr_pdev;
+static bool q8_hardwaremgr_probe_failed; /* Or removed, not bound anyway */
+
+static void q8_hardwaremgr_set_probe_failed(bool failed)
+{
+	spin_lock(&q8_hardwaremgr_profile_lock);
+	q8_hardwaremgr_probe_failed = failed;
+	spin_unlock(&q8_hardwaremgr_profile_lock);
+}
+
+static void __q8_detect q8_hardwaremgr_fill_info(
+	struct q8_hwmgr_device_info *info, struct q8_hardwaremgr_device *dev,
+	const char * const *names, int name_count,
+	unsigned int power_on_delay_ms)
+{
+	info->compatible = dev->compatible;
+	info->model = (dev->model > 0 && dev->model < name_count) ?
+		      names[dev->model] : NULL;
+	info->addr = dev->addr;
+	info->confidence = dev->confidence;
+	info->needs_regulator = dev->needs_regulator;
+	info->power_on_delay_ms = power_on_delay_ms;
+	info->rejected_model =
+		(dev->rejected_model > 0 && dev->rejected_model < name_count) ?
+		names[dev->rejected_model] : NULL;
+	info->rejected_addr = dev->rejected_addr;
+	info->rejected_confidence = dev->rejected_confidence;
+}
+
+static void __q8_detect q8_hardwaremgr_publish_profile(
+	struct q8_hardwaremgr_data *data)
+{
+	struct q8_hwmgr_profile profile = { };
+
+	profile.soc = data->soc;
+	q8_hardwaremgr_fill_info(&profile.touchscreen, &data->touchscreen,
+				 touchscreen_model_names,
+				 ARRAY_SIZE(touchscreen_model_names),
+				 TOUCHSCREEN_POWER_ON_DELAY);
+	q8_hardwaremgr_fill_info(&profile.accelerometer, &data->accelerometer,
+				 accelerometer_model_names,
+				 ARRAY_SIZE(accelerometer_model_names), 0);
+	profile.touchscreen_variant = data->touchscreen_variant;
+	profile.touchscreen_width = data->touchscreen_width;
+	profile.touchscreen_height = data->touchscreen_height;
+	profile.touchscreen_invert_x = data->touchscreen_invert_x;
+	profile.touchscreen_invert_y = data->touchscreen_invert_y;
+	profile.touchscreen_swap_x_y = data->touchscreen_swap_x_y;
+	if (data->touchscreen_fw_name)
+		strlcpy(profile.touchscreen_fw_name, data->touchscreen_fw_name,
+			sizeof(profile.touchscreen_fw_name));
+	profile.has_rda599x = data->has_rda599x;
+	profile.quirks = data->quirks;
+
+	spin_lock(&q8_hardwaremgr_profile_lock);
+	q8_hardwaremgr_profile = profile;
+	q8_hardwaremgr_profile_valid = true;
+	spin_unlock(&q8_hardwaremgr_profile_lock);
+}
+
+static void q8_hardwaremgr_unpublish_profile(void)
+{
+	spin_lock(&q8_hardwaremgr_profile_lock);
+	q8_hardwaremgr_profile_valid = false;
+	spin_unlock(&q8_hardwaremgr_profile_lock);
+}
+
+int q8_hwmgr_get_profile(struct q8_hwmgr_profile *profile)
+{
+	int ret = 0;
+
+	if (!q8_hardwaremgr_pdev)
+		return -ENODEV;
+
+	spin_lock(&q8_hardwaremgr_profile_lock);
+	if (q8_hardwaremgr_profile_valid)
+		*profile = q8_hardwaremgr_profile;
+	else if (q8_hardwaremgr_probe_failed)
+		ret = -ENODEV;
+	else
+		ret = -EPROBE_DEFER;
+	spin_unlock(&q8_hardwaremgr_profile_lock);
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(q8_hwmgr_get_profile);
+
+/* The compact_log summary, from the published profile like the uevent */
+static void __q8_detect q8_hardwaremgr_log_summary(
+	struct q8_hardwaremgr_data *data)
+{
+	struct q8_hwmgr_device_info *ts, *accel;
+	struct q8_hwmgr_profile profile;
+	char ts_str[32] = "none", accel_str[32] = "none";
+
+	if (!compact_log || q8_hwmgr_get_profile(&profile))
+		return;
+
+	ts = &profile.touchscreen;
+	accel = &profile.accelerometer;
+
+	if (ts->compatible)
+		snprintf(ts_str, sizeof(ts_str), "%s@0x%02x",
+			 ts->model, ts->addr);
+	if (accel->compatible)
+		snprintf(accel_str, sizeof(accel_str), "%s@0x%02x",
+			 accel->model, accel->addr);
+
+	dev_info(data->dev, "soc=%s touchscreen=%s variant=%d size=%dx%d invert_x=%d invert_y=%d swap_x_y=%d fw=%s accelerometer=%s rda599x=%d quirks=0x%x\n",
+		 soc_names[profile.soc], ts_str, profile.touchscreen_variant,
+		 profile.touchscreen_width, profile.touchscreen_height,
+		 profile.touchscreen_invert_x, profile.touchscreen_invert_y,
+		 profile.touchscreen_swap_x_y,
+		 profile.touchscreen_fw_name[0] ?
+			profile.touchscreen_fw_name : "none",
+		 accel_str, profile.has_rda599x, profile.quirks);
+}
+
+#define Q8_HARDWAREMGR_UEVENT_VARS	24
+
+/*
+ * Let userspace know detection is done and what was found, so that udev
+ * rules can e.g. select a rotation / calibration profile without polling.
+ */
+static void __q8_detect q8_hardwaremgr_send_uevent(
+	struct q8_hardwaremgr_data *data)
+{
+	struct q8_hwmgr_device_info *ts, *accel;
+	struct q8_hwmgr_profile profile;
+	char *envp[Q8_HARDWAREMGR_UEVENT_VARS + 1] = { };
+	int i, n = 0;
+
+	if (q8_hwmgr_get_profile(&profile))
+		return;
+
+	ts = &profile.touchscreen;
+	accel = &profile.accelerometer;
+
+	envp[n++] = kasprintf(GFP_KERNEL, "Q8_HWMGR_SOC=%s",
+			      soc_names[profile.soc]);
+	if (ts->compatible) {
+		envp[n++] = kasprintf(GFP_KERNEL, "Q8_HWMGR_TOUCHSCREEN=%s",
+				      ts->model);
+		envp[n++] = kasprintf(GFP_KERNEL,
+				      "Q8_HWMGR_TOUCHSCREEN_COMPATIBLE=%s",
+				      ts->compatible);
+		envp[n++] = kasprintf(GFP_KERNEL,
+				      "Q8_HWMGR_TOUCHSCREEN_ADDR=0x%02x",
+				      ts->addr);
+		envp[n++] = kasprintf(GFP_KERNEL,
+				      "Q8_HWMGR_TOUCHSCREEN_CONFIDENCE=%u",
+				      ts->confidence);
+		envp[n++] = kasprintf(GFP_KERNEL,
+				      "Q8_HWMGR_TOUCHSCREEN_VARIANT=%d",
+				      profile.touchscreen_variant);
+		envp[n++] = kasprintf(GFP_KERNEL,
+				      "Q8_HWMGR_TOUCHSCREEN_WIDTH=%d",
+				      profile.touchscreen_width);
+		envp[n++] = kasprintf(GFP_KERNEL,
+				      "Q8_HWMGR_TOUCHSCREEN_HEIGHT=%d",
+				      profile.touchscreen_height);
+		envp[n++] = kasprintf(GFP_KERNEL,
+				      "Q8_HWMGR_TOUCHSCREEN_INVERT_X=%d",
+				      profile.touchscreen_invert_x);
+		envp[n++] = kasprintf(GFP_KERNEL,
+				      "Q8_HWMGR_TOUCHSCREEN_INVERT_Y=%d",
+				      profile.touchscreen_invert_y);
+		envp[n++] = kasprintf(GFP_KERNEL,
+				      "Q8_HWMGR_TOUCHSCREEN_SWAP_X_Y=%d",
+				      profile.touchscreen_swap_x_y);
+		envp[n++] = kasprintf(GFP_KERNEL,
+				      "Q8_HWMGR_TOUCHSCREEN_FW_NAME=%s",
+				      profile.touchscreen_fw_name);
+	}
+	if (accel->compatible) {
+		envp[n++] = kasprintf(GFP_KERNEL, "Q8_HWMGR_ACCELEROMETER=%s",
+				      accel->model);
+		envp[n++] = kasprintf(GFP_KERNEL,
+				      "Q8_HWMGR_ACCELEROMETER_COMPATIBLE=%s",
+				      accel->compatible);
+		envp[n++] = kasprintf(GFP_KERNEL,
+				      "Q8_HWMGR_ACCELEROMETER_ADDR=0x%02x",
+				      accel->addr);
+		envp[n++] = kasprintf(GFP_KERNEL,
+				      "Q8_HWMGR_ACCELEROMETER_CONFIDENCE=%u",
+				      accel->confidence);
+	}
+	if (ts->rejected_model)
+		envp[n++] = kasprintf(GFP_KERNEL,
+				      "Q8_HWMGR_TOUCHSCREEN_REJECTED=%s@0x%02x:%u",
+				      ts->rejected_model, ts->rejected_addr,
+				      ts->rejected_confidence);
+	if (accel->rejected_model)
+		envp[n++] = kasprintf(GFP_KERNEL,
+				      "Q8_HWMGR_ACCELEROMETER_REJECTED=%s@0x%02x:%u",
+				      accel->rejected_model,
+				      accel->rejected_addr,
+				      accel->rejected_confidence);
+	envp[n++] = kasprintf(GFP_KERNEL, "Q8_HWMGR_RDA599X=%d",
+			      profile.has_rda599x);
+	envp[n++] = kasprintf(GFP_KERNEL, "Q8_HWMGR_QUIRKS=0x%x",
+			      profile.quirks);
+
+	for (i = 0; i < n; i++) {
+		if (!envp[i]) {
+			dev_warn(data->dev, "Out of memory creating uevent\n");
+			goto out;
+		}
+	}
+
+	kobject_uevent_env(&data->dev->kobj, KOBJ_CHANGE, envp);
+out:
+	for (i = 0; i < n; i++)
+		kfree(envp[i]);
+}
+
+static void __q8_detect q8_hardwaremgr_apply(struct q8_hardwaremgr_data *data)
+{
+	int i;
+
+	q8_hardwaremgr_configure_touchscreen(data);
+	q8_hardwaremgr_publish_profile(data);
+
+	for (i = 0; i < ARRAY_SIZE(q8_hardwaremgr_classes); i++)
+		q8_hardwaremgr_classes[i].apply(data);
+	q8_hardwaremgr_apply_quirks(data);
+
+	q8_hardwaremgr_mark(data, timing_applied);
+	q8_hardwaremgr_log_summary(data);
+	q8_hardwaremgr_send_uevent(data);
+}
+
+static void q8_hardwaremgr_revert(struct q8_hardwaremgr_data *data)
+{
+	q8_hardwaremgr_unpublish_profile();
+	q8_hardwaremgr_revert_cset(data, &data->quirks_cset,
+				   &data->quirks_applied);
+	q8_hardwaremgr_revert_cset(data, &data->accelerometer.cset,
+				   &data->accelerometer.applied);
+	q8_hardwaremgr_revert_cset(data, &data->touchscreen.cset,
+				   &data->touchscreen.applied);
+	q8_hardwaremgr_release_firmware(data);
+}
+
+static void q8_hardwaremgr_reset_touchscreen_config(
+	struct q8_hardwaremgr_data *data)
+{
+	data->touchscreen_variant = 0;
+	data->touchscreen_width = 0;
+	data->touchscreen_height = 0;
+	data->touchscreen_invert_x = 0;
+	data->touchscreen_invert_y = 0;
+	data->touchscreen_swap_x_y = 0;
+	data->touchscreen_fw_name = NULL;
+	kfree(data->user_fw_name);
+	data->user_fw_name = NULL;
+	data->touchscreen_rule = NULL;
+}
+
+/* Forget everything detect() and apply() found, must be reverted first */
+static void q8_hardwaremgr_reset(struct q8_hardwaremgr_data *data)
+{
+	struct q8_hardwaremgr_device *devs[] = {
+		&data->touchscreen, &data->accelerometer };
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(devs); i++) {
+		devs[i]->model = 0;
+		devs[i]->addr = 0;
+		devs[i]->confidence = 0;
+		devs[i]->rejected_model = 0;
+		devs[i]->rejected_addr = 0;
+		devs[i]->rejected_confidence = 0;
+		devs[i]->compatible = NULL;
+		of_node_put(devs[i]->bus_np);
+		devs[i]->bus_np = NULL;
+		devs[i]->delete_regulator = false;
+		devs[i]->needs_regulator = false;
+	}
+
+	q8_hardwaremgr_reset_touchscreen_config(data);
+	data->has_rda599x = false;
+	data->quirks = 0;
+	q8_hardwaremgr_shadow_discard(data);
+}
+
+/*
+ * There is only ever one q8-hwmgr device, the param set callbacks use this
+ * to find it. Protected by q8_hardwaremgr_active_lock.
+ */
+static struct q8_hardwaremgr_data *q8_hardwaremgr_active;
+static DEFINE_MUTEX(q8_hardwaremgr_active_lock);
+
+#ifndef Q8_HWMGR_ONESHOT
+/* Rebuild the touchscreen changeset after a touchscreen param change */
+static void q8_hardwaremgr_touchscreen_work(struct work_struct *work)
+{
+	struct q8_hardwaremgr_data *data =
+		container_of(work, struct q8_hardwaremgr_data, touchscreen_work);
+
+	mutex_lock(&data->lock);
+
+	if (data->touchscreen.model != touchscreen_unknown) {
+		q8_hardwaremgr_revert_cset(data, &data->touchscreen.cset,
+					   &data->touchscreen.applied);
+		q8_hardwaremgr_release_firmware(data);
+		q8_hardwaremgr_reset_touchscreen_config(data);
+		q8_hardwaremgr_configure_touchscreen(data);
+		q8_hardwaremgr_publish_profile(data);
+		q8_hardwaremgr_apply_touchscreen(data);
+		q8_hardwaremgr_log_summary(data);
+		q8_hardwaremgr_send_uevent(data);
+	}
+
+	mutex_unlock(&data->lock);
+}
+
+static void q8_hardwaremgr_touchscreen_param_changed(void)
+{
+	mutex_lock(&q8_hardwaremgr_active_lock);
+	if (q8_hardwaremgr_active)
+		schedule_work(&q8_hardwaremgr_active->touchscreen_work);
+	mutex_unlock(&q8_hardwaremgr_active_lock);
+}
+
+/*
+ * The accelerometer only matters for rotation once the UI is up, but the
+ * gsl1680 touchscreen heuristics depend on it. In lazy_accelerometer mode
+ * the touchscreen gets applied first, using the accelerometer_hint and
+ * rda599x_hint params (e.g. saved from a previous boot's uevent) as input
+ * for the heuristics. The accelerometer is detected afterwards from a work
+ * item and the touchscreen is only re-applied if the real accelerometer
+ * selects a different heuristics rule.
+ */
+static bool lazy_accelerometer;
+module_param(lazy_accelerometer, bool, 0444);
+MODULE_PARM_DESC(lazy_accelerometer, "Apply the touchscreen before detecting the accelerometer");
+
+static char *accelerometer_hint;
+module_param(accelerometer_hint, charp, 0444);
+MODULE_PARM_DESC(accelerometer_hint, "Expected accelerometer for lazy_accelerometer as model@addr, e.g. da280@0x26");
+
+static bool rda599x_hint;
+module_param(rda599x_hint, bool, 0444);
+MODULE_PARM_DESC(rda599x_hint, "Expect a rda599x for lazy_accelerometer");
+
+#define ACCELEROMETER_RETRY_DELAY	100
+#define ACCELEROMETER_MAX_RETRIES	50
+
+static void q8_hardwaremgr_apply_hints(struct q8_hardwaremgr_data *data)
+{
+	char *at;
+	u16 addr;
+	int i;
+
+	data->has_rda599x = rda599x_hint;
+
+	if (!accelerometer_hint)
+		return;
+
+	at = strchr(accelerometer_hint, '@');
+	if (!at || kstrtou16(at + 1, 0, &addr))
+		goto invalid;
+
+	for (i = 1; i < ARRAY_SIZE(accelerometer_model_names); i++) {
+		if (strlen(accelerometer_model_names[i]) ==
+							at - accelerometer_hint &&
+		    !strncmp(accelerometer_model_names[i], accelerometer_hint,
+			     at - accelerometer_hint)) {
+			data->accelerometer.model = i;
+			data->accelerometer.addr = addr;
+			return;
+		}
+	}
+
+invalid:
+	dev_warn(data->dev, "Ignoring invalid accelerometer_hint %s\n",
+		 accelerometer_hint);
+}
+
+static int q8_hardwaremgr_detect_lazy(struct q8_hardwaremgr_data *data)
+{
+	int ret;
+
+	q8_hardwaremgr_shadow_start(data);
+
+	ret = q8_hardwaremgr_do_probe(data, &data->touchscreen, "touchscreen",
+				      q8_hardwaremgr_probe_touchscreen, NULL);
+	if (ret) {
+		q8_hardwaremgr_shadow_discard(data);
+		return ret;
+	}
+
+	q8_hardwaremgr_apply_hints(data);
+	q8_hardwaremgr_configure_touchscreen(data);
+
+	/* The hints are heuristics input only, not detection results */
+	data->accelerometer.model = accel_unknown;
+	data->accelerometer.addr = 0;
+	data->has_rda599x = false;
+
+	q8_hardwaremgr_publish_profile(data);
+	q8_hardwaremgr_apply_touchscreen(data);
+
+	data->accelerometer_retries = 0;
+	schedule_delayed_work(&data->accelerometer_work, 0);
+
+	return 0;
+}
+
+static void q8_hardwaremgr_accelerometer_work(struct work_struct *work)
+{
+	struct q8_hardwaremgr_data *data =
+		container_of(to_delayed_work(work), struct q8_hardwaremgr_data,
+			     accelerometer_work);
+	const struct q8_hardwaremgr_ts_rule *rule;
+	int ret;
+
+	mutex_lock(&data->lock);
+
+	ret = q8_hardwaremgr_do_probe(data, &data->accelerometer,
+				      "accelerometer",
+				      q8_hardwaremgr_probe_accelerometer, NULL);
+	if (ret == -EPROBE_DEFER &&
+	    data->accelerometer_retries++ < ACCELEROMETER_MAX_RETRIES) {
+		schedule_delayed_work(&data->accelerometer_work,
+				msecs_to_jiffies(ACCELEROMETER_RETRY_DELAY));
+		goto out;
+	}
+	if (ret)
+		dev_err(data->dev, "Error probing accelerometer %d\n", ret);
+
+	if (data->has_rda599x)
+		q8_hardwaremgr_log(dev_info, data->dev, "Found a rda599x sdio/i2c wifi/bt/fm combo chip\n");
+
+	q8_hardwaremgr_shadow_finish(data);
+	q8_hardwaremgr_mark(data, timing_detected);
+
+	rule = q8_hardwaremgr_find_ts_rule(data);
+	if (data->touchscreen.model != touchscreen_unknown &&
+	    !q8_hardwaremgr_ts_rule_equivalent(rule, data->touchscreen_rule)) {
+		q8_hardwaremgr_log(dev_info, data->dev, "Accelerometer does not match hint, re-applying touchscreen\n");
+		q8_hardwaremgr_revert_cset(data, &data->touchscreen.cset,
+					   &data->touchscreen.applied);
+		q8_hardwaremgr_release_firmware(data);
+		q8_hardwaremgr_reset_touchscreen_config(data);
+		data->quirks = 0;
+		q8_hardwaremgr_configure_touchscreen(data);
+		q8_hardwaremgr_publish_profile(data);
+		q8_hardwaremgr_apply_touchscreen(data);
+	} else {
+		q8_hardwaremgr_publish_profile(data);
+	}
+
+	q8_hardwaremgr_apply_accelerometer(data);
+	q8_hardwaremgr_apply_quirks(data);
+
+	q8_hardwaremgr_mark(data, timing_applied);
+	q8_hardwaremgr_log_summary(data);
+	q8_hardwaremgr_send_uevent(data);
+out:
+	mutex_unlock(&data->lock);
+}
+
+/* Move the detection results, not the changeset, of a device to another */
+static void q8_hardwaremgr_move_result(struct q8_hardwaremgr_device *dst,
+				       struct q8_hardwaremgr_device *src)
+{
+	dst->model = src->model;
+	dst->addr = src->addr;
+	dst->confidence = src->confidence;
+	dst->rejected_model = src->rejected_model;
+	dst->rejected_addr = src->rejected_addr;
+	dst->rejected_confidence = src->rejected_confidence;
+	dst->compatible = src->compatible;
+	dst->bus_np = src->bus_np;
+	dst->delete_regulator = src->delete_regulator;
+	dst->needs_regulator = src->needs_regulator;
+	src->bus_np = NULL;
+}
+
+/*
+ * Revert the current configuration, detect again and apply the result, for
+ * re-validating a unit after swapping parts without a reboot. The template
+ * node fixups done at probe time are not reverted, they are idempotent.
+ * Reverting unbinds the touchscreen and accelerometer drivers, which frees
+ * the power gpio and regulator for do_probe(), so detection can not be done
+ * before reverting. When it fails the previous results get applied again.
+ */
+static int q8_hardwaremgr_rescan(struct q8_hardwaremgr_data *data)
+{
+	struct q8_hardwaremgr_device old_ts = { }, old_accel = { };
+	bool old_rda599x;
+	int ret;
+
+	/* A rescan always does a full, non lazy, detection */
+	cancel_delayed_work_sync(&data->accelerometer_work);
+
+	mutex_lock(&data->lock);
+
+	q8_hardwaremgr_revert(data);
+	q8_hardwaremgr_move_result(&old_ts, &data->touchscreen);
+	q8_hardwaremgr_move_result(&old_accel, &data->accelerometer);
+	old_rda599x = data->has_rda599x;
+	q8_hardwaremgr_reset(data);
+
+	q8_hardwaremgr_timing_start(data, ktime_get_ns());
+	q8_hardwaremgr_capture_start();
+	q8_hardwaremgr_stats_reset();
+	q8_hardwaremgr_mark(data, timing_probe);
+
+	ret = q8_hardwaremgr_detect(data);
+	if (ret) {
+		dev_warn(data->dev, "Rescan failed %d, restoring previous configuration\n",
+			 ret);
+		q8_hardwaremgr_reset(data);
+		q8_hardwaremgr_move_result(&data->touchscreen, &old_ts);
+		q8_hardwaremgr_move_result(&data->accelerometer, &old_accel);
+		data->has_rda599x = old_rda599x;
+	} else {
+		of_node_put(old_ts.bus_np);
+		of_node_put(old_accel.bus_np);
+	}
+	q8_hardwaremgr_apply(data);
+
+	mutex_unlock(&data->lock);
+
+	return ret == -EPROBE_DEFER ? -EAGAIN : ret;
+}
+
+static ssize_t rescan_store(struct device *dev, struct device_attribute *attr,
+			    const char *buf, size_t count)
+{
+	struct q8_hardwaremgr_data *data = dev_get_drvdata(dev);
+	bool rescan;
+	int ret;
+
+	ret = strtobool(buf, &rescan);
+	if (ret)
+		return ret;
+
+	if (rescan) {
+		ret = q8_hardwaremgr_rescan(data);
+		if (ret)
+			return ret;
+	}
+
+	return count;
+}
+static DEVICE_ATTR_WO(rescan);
+
+#define Q8_HARDWAREMGR_REPORT_SIZE	1024
+
+static DEFINE_MUTEX(q8_hardwaremgr_replay_lock);
+static char q8_hardwaremgr_replay_report[Q8_HARDWAREMGR_REPORT_SIZE];
+static size_t q8_hardwaremgr_replay_report_len;
+
+static void q8_hardwaremgr_replay_config(void)
+{
+	struct q8_hardwaremgr_replay *r = &q8_hardwaremgr_replay_state;
+	int ts_count = ARRAY_SIZE(touchscreen_candidates);
+	int accel_count = ARRAY_SIZE(accelerometer_candidates);
+	const struct q8_hardwaremgr_rec *rec;
+	const u8 *payload;
+	int i;
+
+	rec = q8_hardwaremgr_replay_next(Q8_HWMGR_REC_CONFIG, &payload);
+	if (!rec)
+		return;
+
+	r->prescan = rec->flags;
+
+	/* Captured with different candidate tables, use table order */
+	if (le16_to_cpu(rec->len) != (ts_count + accel_count) * 4)
+		return;
+
+	for (i = 0; i < ts_count; i++)
+		r->touchscreen_hits[i] = get_unaligned_le32(payload + i * 4);
+	for (i = 0; i < accel_count; i++)
+		r->accelerometer_hits[i] =
+			get_unaligned_le32(payload + (ts_count + i) * 4);
+}
+
+/*
+ * Run the bus probe functions against a capture log. The power sequencing
+ * done by do_probe() is not replayed, each recorded bus pass is. Sleeps are
+ * accounted for but skipped, so the replay time is the engine's own cost.
+ */
+static void q8_hardwaremgr_replay(const u8 *buf, size_t len)
+{
+	struct q8_hardwaremgr_replay *r = &q8_hardwaremgr_replay_state;
+	unsigned int ts_hits[ARRAY_SIZE(touchscreen_candidates)] = { };
+	unsigned int accel_hits[ARRAY_SIZE(accelerometer_candidates)] = { };
+	const struct q8_hardwaremgr_rec *probe, *done;
+	char *out = q8_hardwaremgr_replay_report;
+	size_t size = Q8_HARDWAREMGR_REPORT_SIZE, n = 0;
+	struct q8_hardwaremgr_data *data;
+	struct q8_hardwaremgr_device *dev;
+	const char * const *names;
+	bus_probe_func func;
+	int count, ret;
+	u64 start, ns;
+
+	memset(r, 0, sizeof(*r));
+	r->buf = buf;
+	r->len = len;
+	r->touchscreen_hits = ts_hits;
+	r->accelerometer_hits = accel_hits;
+
+	data = kzalloc(sizeof(*data), GFP_KERNEL);
+	if (!data) {
+		n = scnprintf(out, size, "Out of memory\n");
+		goto out;
+	}
+	data->dev = q8_hardwaremgr_pdev ? &q8_hardwaremgr_pdev->dev : NULL;
+
+	q8_hardwaremgr_replay_config();
+
+	while (!r->diverged && r->pos < r->len) {
+		probe = q8_hardwaremgr_replay_next(Q8_HWMGR_REC_PROBE, NULL);
+		if (!probe)
+			break;
+
+		if (probe->value) {
+			dev = &data->accelerometer;
+			func = q8_hardwaremgr_probe_accelerometer;
+			names = accelerometer_model_names;
+			count = ARRAY_SIZE(accelerometer_model_names);
+		} else {
+			dev = &data->touchscreen;
+			func = q8_hardwaremgr_probe_touchscreen;
+			names = touchscreen_model_names;
+			count = ARRAY_SIZE(touchscreen_model_names);
+		}
+		dev->model = 0;
+		dev->addr = 0;
+		data->legacy_engine = probe->flags & Q8_HWMGR_REC_LEGACY;
+		data->powered = probe->flags & Q8_HWMGR_REC_POWERED;
+
+		start = ktime_get_ns();
+		ret = func(data, NULL);
+		ns = ktime_get_ns() - start;
+
+		done = q8_hardwaremgr_replay_next(Q8_HWMGR_REC_DONE, NULL);
+		if (!done)
+			break;
+
+		n += scnprintf(out + n, size - n,
+			       "%s%s: %d %s@0x%02x recorded %d %s@0x%02x in %u us, replayed in %llu us\n",
+			       probe->value ? "accelerometer" : "touchscreen",
+			       (probe->flags & Q8_HWMGR_REC_LEGACY) ?
+					" (legacy)" : "",
+			       ret, q8_hardwaremgr_model_name(names, count,
+							      dev->model),
+			       dev->addr, (s16)le16_to_cpu(done->value),
+			       q8_hardwaremgr_model_name(names, count,
+							 done->flags),
+			       done->addr,
+			       le32_to_cpu(done->time_us) -
+					le32_to_cpu(probe->time_us),
+			       div_u64(ns, NSEC_PER_USEC));
 	}
 
-	/* First try with only the power gpio driven high */
-	if (gpio) {
-		ret = gpiod_direction_output(gpio, 1);
-		if (ret)
-			goto put_gpio;
-	}
+	n += scnprintf(out + n, size - n,
+		       "records %u transfers %u sleeps %u ms rda599x %d: %s at offset %zu\n",
+		       r->records, r->transfers, r->sleep_ms,
+		       data->has_rda599x,
+		       r->diverged ? "diverged" : "matched", r->pos);
+	kfree(data);
+out:
+	q8_hardwaremgr_replay_report_len = n;
+}
 
-	dev_info(data->dev, "Probing %s without a regulator\n", prefix);
-	ret = func(data, adap);
-	if (ret != 0 && reg) {
-		/* Second try, also enable the regulator */
-		ret = regulator_enable(reg);
-		if (ret)
-			goto restore_gpio;
+static ssize_t q8_hardwaremgr_replay_write(struct file *file,
+					   const char __user *ubuf,
+					   size_t count, loff_t *ppos)
+{
+	u8 *buf;
 
-		dev_info(data->dev, "Probing %s with a regulator\n", prefix);
-		ret = func(data, adap);
+	/* The log must be written in one go */
+	if (*ppos || count > Q8_HARDWAREMGR_CAPTURE_SIZE)
+		return -EINVAL;
 
-/* 4.9 silead driver lacks regulator support, leave it enabled */
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 10, 0)
-		regulator_disable(reg);
-#endif
-	} else if (reg)
-		dev->delete_regulator = true; /* Regulator not needed */
+	buf = memdup_user(ubuf, count);
+	if (IS_ERR(buf))
+		return PTR_ERR(buf);
 
-	if (ret == 0)
-		dev_info(data->dev, "Found %s at 0x%02x\n",
-			 dev->compatible, dev->addr);
-	else
-		ret = 0; /* Not finding a device is not an error */
+	mutex_lock(&q8_hardwaremgr_replay_lock);
+	q8_hardwaremgr_replay(buf, count);
+	mutex_unlock(&q8_hardwaremgr_replay_lock);
 
-restore_gpio:
-	if (gpio)
-		gpiod_direction_output(gpio, 0);
-put_gpio:
-	if (gpio)
-		gpiod_put(gpio);
-put_reg:
-	if (reg)
-		regulator_put(reg);
-put_adapter:
-	i2c_put_adapter(adap);
-
-put_pinctrl:
-	if (pinctrl)
-		pinctrl_put(pinctrl);
-put_node:
-	data->dev->of_node = NULL;
-	of_node_put(np);
+	kfree(buf);
+	*ppos += count;
+	return count;
+}
+
+static ssize_t q8_hardwaremgr_replay_read(struct file *file, char __user *ubuf,
+					  size_t count, loff_t *ppos)
+{
+	ssize_t ret;
+
+	mutex_lock(&q8_hardwaremgr_replay_lock);
+	ret = simple_read_from_buffer(ubuf, count, ppos,
+				      q8_hardwaremgr_replay_report,
+				      q8_hardwaremgr_replay_report_len);
+	mutex_unlock(&q8_hardwaremgr_replay_lock);
 
 	return ret;
 }
 
+static const struct file_operations q8_hardwaremgr_replay_fops = {
+	.owner	= THIS_MODULE,
+	.open	= simple_open,
+	.read	= q8_hardwaremgr_replay_read,
+	.write	= q8_hardwaremgr_replay_write,
+	.llseek	= default_llseek,
+};
+
 /*
- * sun5i-a13-q8-tablet.dts on kernel 4.8 is missing the touchscreen
- * template node, add it.
+ * Fuzzing of the identification code: the bus probe functions run against
+ * a simulated bus on which each address is present or not at random and
+ * reads return random, all 0x00, all 0xff, or random but per register
+ * stable contents, the latter passing the secondary id checks whenever
+ * the id registers happen to match. The collision pattern is the stable
+ * one, with each address also answering a random supported chip's id
+ * registers. Except for identifying the chip an address was given by the
+ * collision pattern, every identification is a false positive. The worst
+ * case transfer count and sleep time per bus pass give an upper bound for
+ * the detection latency.
  */
-static int q8_hardwaremgr_add_touchscreen_node(struct q8_hardwaremgr_data *data)
+#define Q8_HARDWAREMGR_FUZZ_MAX_ITERATIONS	100000
+#define Q8_HARDWAREMGR_FUZZ_MAX_REPORTS		8
+
+static const char * const q8_hardwaremgr_fuzz_pattern_names[] = {
+	[q8_fuzz_random]	= "random",
+	[q8_fuzz_zeros]		= "zeros",
+	[q8_fuzz_ones]		= "ones",
+	[q8_fuzz_stable]	= "stable",
+	[q8_fuzz_collision]	= "collision",
+};
+
+/* Whether the collision pattern put the identified chip at its address */
+static bool q8_hardwaremgr_fuzz_genuine(struct q8_hardwaremgr_replay *r,
+					bool accelerometer, int model, u8 addr)
 {
-	/* FIXME */
-	return 0;
+	const struct q8_hardwaremgr_fuzz_chip *chip =
+		&q8_hardwaremgr_fuzz_chips[r->chip[addr]];
+
+	return r->pattern == q8_fuzz_collision &&
+	       chip->accelerometer == accelerometer && chip->model == model;
 }
 
-/*
- * Originally the q8-hwmgr design was for the dt to already have a template
- * touchscreen node on the right i2c bus, but since q8-hwmgr is not (yet?)
- * upstream that node may be missing or incomplete
- */
-static int q8_hardwaremgr_fixup_touchscreen_node(
-	struct q8_hardwaremgr_data *data)
+static char q8_hardwaremgr_fuzz_report[Q8_HARDWAREMGR_REPORT_SIZE];
+static size_t q8_hardwaremgr_fuzz_report_len;
+
+static void q8_hardwaremgr_fuzz(unsigned int iterations, u32 seed)
 {
-	struct device_node *ts_np, *reg_np = NULL;
-	struct property *prop;
-	struct of_changeset cset;
-	struct regulator *reg;
-	int ret = 0;
+	struct q8_hardwaremgr_replay *r = &q8_hardwaremgr_replay_state;
+	unsigned int ts_hits[ARRAY_SIZE(touchscreen_candidates)] = { };
+	unsigned int accel_hits[ARRAY_SIZE(accelerometer_candidates)] = { };
+	unsigned int transfers[ARRAY_SIZE(q8_hardwaremgr_classes)] = { };
+	unsigned int sleep_ms[ARRAY_SIZE(q8_hardwaremgr_classes)] = { };
+	unsigned int false_pos[ARRAY_SIZE(q8_hardwaremgr_classes)] = { };
+	unsigned int rda599x_false_pos = 0, reported = 0;
+	char *out = q8_hardwaremgr_fuzz_report;
+	size_t size = Q8_HARDWAREMGR_REPORT_SIZE, n = 0;
+	struct q8_hardwaremgr_data *data;
+	unsigned int it, addr;
+	int i, ret;
 
-	if (data->soc == a13)
-		return q8_hardwaremgr_add_touchscreen_node(data);
+	memset(r, 0, sizeof(*r));
+	r->fuzz = true;
+	r->prescan = prescan;
+	r->touchscreen_hits = ts_hits;
+	r->accelerometer_hits = accel_hits;
 
-	ts_np = of_find_node_by_name(of_root, "touchscreen");
-	reg_np = of_find_node_by_name(of_root, "ldo_io1");
-	if (!ts_np || !reg_np) {
-		dev_err(data->dev,
-			"Error dt-nodes missing touchscreen %p, ldo_io1 %p\n",
-			ts_np, reg_np);
-		ret = -EINVAL;
-		goto out_put_np;
+	data = kzalloc(sizeof(*data), GFP_KERNEL);
+	if (!data) {
+		n = scnprintf(out, size, "Out of memory\n");
+		goto out;
 	}
+	data->dev = q8_hardwaremgr_pdev ? &q8_hardwaremgr_pdev->dev : NULL;
+
+	for (it = 0; it < iterations; it++) {
+		r->pattern = it % q8_fuzz_pattern_count;
+		r->seed = seed + it;
+		prandom_seed_state(&r->rnd, r->seed);
+		for (addr = 0; addr < Q8_HARDWAREMGR_ADDR_COUNT; addr++)
+			if (prandom_u32_state(&r->rnd) & 1)
+				set_bit(addr, r->present);
+			else
+				clear_bit(addr, r->present);
+		for (addr = 0; addr < Q8_HARDWAREMGR_ADDR_COUNT; addr++)
+			r->chip[addr] = prandom_u32_state(&r->rnd) %
+					ARRAY_SIZE(q8_hardwaremgr_fuzz_chips);
+		memset(r->reg, 0, sizeof(r->reg));
+
+		for (i = 0; i < ARRAY_SIZE(q8_hardwaremgr_classes); i++) {
+			const struct q8_hardwaremgr_class *class =
+				&q8_hardwaremgr_classes[i];
+			struct q8_hardwaremgr_device *dev =
+				(void *)data + class->offset;
+
+			dev->model = 0;
+			dev->addr = 0;
+			dev->confidence = 0;
+			dev->compatible = NULL;
+			data->has_rda599x = false;
+			r->transfers = 0;
+			r->sleep_ms = 0;
+
+			ret = class->probe(data, NULL);
+
+			transfers[i] = max(transfers[i], r->transfers);
+			sleep_ms[i] = max(sleep_ms[i], r->sleep_ms);
+			if (data->has_rda599x &&
+			    !q8_hardwaremgr_fuzz_genuine(r, false, 0, 0x11))
+				rda599x_false_pos++;
+			if (ret || q8_hardwaremgr_fuzz_genuine(r,
+					dev == &data->accelerometer,
+					dev->model, dev->addr))
+				continue;
+
+			false_pos[i]++;
+			if (reported++ >= Q8_HARDWAREMGR_FUZZ_MAX_REPORTS)
+				continue;
+
+			n += scnprintf(out + n, size - n,
+				       "false positive %s %s@0x%02x confidence %d, seed %u pattern %s\n",
+				       class->name, dev->compatible, dev->addr,
+				       dev->confidence, r->seed,
+				       q8_hardwaremgr_fuzz_pattern_names[r->pattern]);
+		}
 
-	reg = regulator_get_optional(NULL, "ldo_io1");
-	if (IS_ERR(reg) && PTR_ERR(reg) == -ENODEV)
-		reg = regulator_get_optional(NULL, "vcc-touchscreen");
-	if (IS_ERR(reg)) {
-		ret = PTR_ERR(reg);
-		if (ret != -EPROBE_DEFER)
-			dev_err(data->dev, "Error could not get ldo_io1 regulator %d\n",
-				ret);
-		goto out_put_np;
+		cond_resched();
 	}
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 10, 0)
-	if (!reg->rdev->dev.of_node) {
-		reg->rdev->dev.of_node = reg_np;
-	} else if (reg->rdev->dev.of_node != reg_np) {
-		dev_err(data->dev, "Error ldo_io1 dt-node mismatch\n");
-		goto out_put_reg;
-	}
+	for (i = 0; i < ARRAY_SIZE(q8_hardwaremgr_classes); i++)
+		n += scnprintf(out + n, size - n,
+			       "%s: worst case %u transfers %u ms sleep, %u false positives\n",
+			       q8_hardwaremgr_classes[i].name, transfers[i],
+			       sleep_ms[i], false_pos[i]);
 
-	/* See if the constraints are already set */
-	prop = of_find_property(reg_np, "regulator-min-microvolt", NULL);
-	if (prop)
-		goto add_touchscreen_supply_prop;
+	n += scnprintf(out + n, size - n,
+		       "rda599x: %u false positives, %u iterations from seed %u\n",
+		       rda599x_false_pos, iterations, seed);
+	kfree(data);
+out:
+	r->fuzz = false;
+	q8_hardwaremgr_fuzz_report_len = n;
+}
 
-	of_changeset_init(&cset);
-	of_changeset_add_property_u32(&cset, reg_np, "regulator-min-microvolt",
-				      3300000);
-	of_changeset_add_property_u32(&cset, reg_np, "regulator-max-microvolt",
-				      3300000);
-	of_changeset_update_property_string(&cset, reg_np, "regulator-name", "vcc-touchscreen");
-	of_changeset_update_property_string(&cset, reg_np, "status", "okay");
-	of_changeset_apply(&cset);
-	of_changeset_destroy(&cset);
+static ssize_t q8_hardwaremgr_fuzz_write(struct file *file,
+					 const char __user *ubuf,
+					 size_t count, loff_t *ppos)
+{
+	unsigned int iterations;
+	char buf[32];
+	u32 seed = 0;
 
-	/*
-	 * HACK HACK HACK update the constraints after the regulator core
-	 * has already set them from the incomplete dt.
-	 */
-	reg->rdev->constraints->min_uV = 3300000;
-	reg->rdev->constraints->max_uV = 3300000;
-	reg->rdev->constraints->name = kstrdup("vcc-touchscreen", GFP_KERNEL);
-	reg->rdev->constraints->valid_ops_mask |=
-		REGULATOR_CHANGE_VOLTAGE | REGULATOR_CHANGE_STATUS;
+	if (*ppos || count >= sizeof(buf))
+		return -EINVAL;
 
-	ret = regulator_set_voltage(reg, 3300000, 3300000);
-	if (ret) {
-		dev_err(data->dev, "Error setting ldo_io1 voltage %d\n", ret);
-		goto out_put_reg;
-	}
+	if (copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = 0;
 
-add_touchscreen_supply_prop:
-#endif
-	/* See if the supply are already set */
-	prop = of_find_property(ts_np, "vddio-supply", NULL);
-	if (prop)
-		goto out_put_reg;
+	if (sscanf(buf, "%u %u", &iterations, &seed) < 1 ||
+	    !iterations || iterations > Q8_HARDWAREMGR_FUZZ_MAX_ITERATIONS)
+		return -EINVAL;
 
-	/* The reg_np may not have a phandle */
-	if (!reg_np->phandle)
-		reg_np->phandle = of_gen_phandle();
+	mutex_lock(&q8_hardwaremgr_replay_lock);
+	q8_hardwaremgr_fuzz(iterations, seed);
+	mutex_unlock(&q8_hardwaremgr_replay_lock);
 
-	of_changeset_init(&cset);
-	/* The regulator phandle has no args */
-	of_changeset_add_property_u32(&cset, ts_np, "vddio-supply",
-				      reg_np->phandle);
-	of_changeset_apply(&cset);
-	of_changeset_destroy(&cset);
+	*ppos += count;
+	return count;
+}
+
+static ssize_t q8_hardwaremgr_fuzz_read(struct file *file, char __user *ubuf,
+					size_t count, loff_t *ppos)
+{
+	ssize_t ret;
+
+	mutex_lock(&q8_hardwaremgr_replay_lock);
+	ret = simple_read_from_buffer(ubuf, count, ppos,
+				      q8_hardwaremgr_fuzz_report,
+				      q8_hardwaremgr_fuzz_report_len);
+	mutex_unlock(&q8_hardwaremgr_replay_lock);
 
-out_put_reg:
-	regulator_put(reg);
-out_put_np:
-	of_node_put(reg_np);
-	of_node_put(ts_np);
 	return ret;
 }
 
-/*
- * Originally the q8-hwmgr design was for the dt to already have an empty
- * accel node on the right i2c bus, but since q8-hwmgr is not (yet?) upstream
- * that node may be missing.
- */
-static int q8_hardwaremgr_add_accel_node(struct q8_hardwaremgr_data *data)
+static const struct file_operations q8_hardwaremgr_fuzz_fops = {
+	.owner	= THIS_MODULE,
+	.open	= simple_open,
+	.read	= q8_hardwaremgr_fuzz_read,
+	.write	= q8_hardwaremgr_fuzz_write,
+	.llseek	= default_llseek,
+};
+#else
+/* The detection code is gone, param changes only apply on the next boot */
+static void q8_hardwaremgr_touchscreen_param_changed(void)
 {
-	struct device_node *np, *parent;
-	struct of_changeset cset;
-	int ret = 0;
+}
+#endif /* ifndef Q8_HWMGR_ONESHOT */
 
-	np = of_find_node_by_name(of_root, "accelerometer");
-	if (np) {
-		of_node_put(np);
-		return 0; /* accelerometer node already exists */
-	}
+static int __q8_detect q8_hardwaremgr_initial_detect(
+	struct q8_hardwaremgr_data *data)
+{
+	int ret;
 
-	parent = of_find_node_by_path("/soc@01c00000/i2c@01c2b000");
-	if (!parent) {
-		dev_err(data->dev, "Error i2c1 node is missing\n");
-		return -EINVAL;
-	}
+	if (q8_hardwaremgr_profile_param) {
+		ret = q8_hardwaremgr_load_profile(data,
+						  q8_hardwaremgr_profile_param);
+		if (ret == 0) {
+			q8_hardwaremgr_log(dev_info, data->dev, "Using hardware profile %s\n",
+					   q8_hardwaremgr_profile_param);
+			q8_hardwaremgr_mark(data, timing_detected);
+			q8_hardwaremgr_apply(data);
+			return 0;
+		}
 
-	of_changeset_init(&cset);
-	np = of_changeset_create_device_node(&cset, parent, "accelerometer");
-	if (IS_ERR(np)) {
-		ret = PTR_ERR(np);
-		goto out;
+		dev_warn(data->dev, "Ignoring invalid hardware profile %s: %d\n",
+			 q8_hardwaremgr_profile_param, ret);
 	}
-	of_changeset_add_property_string(&cset, np, "name", "accelerometer");
-	of_changeset_add_property_string(&cset, np, "status", "disabled");
-	of_changeset_attach_node(&cset, np);
-	of_changeset_apply(&cset);
-out:
-	of_changeset_destroy(&cset);
-	of_node_put(parent);
+
+#ifndef Q8_HWMGR_ONESHOT
+	if (lazy_accelerometer)
+		return q8_hardwaremgr_detect_lazy(data);
+#endif
+
+	ret = q8_hardwaremgr_detect(data);
+	if (ret == 0)
+		q8_hardwaremgr_apply(data);
+
 	return ret;
 }
 
-static int q8_hardwaremgr_probe(struct platform_device *pdev)
+static struct attribute *q8_hardwaremgr_attrs[] = {
+#ifndef Q8_HWMGR_ONESHOT
+	&dev_attr_rescan.attr,
+#endif
+	&dev_attr_timings.attr,
+	&dev_attr_shadow.attr,
+	&dev_attr_profile.attr,
+	NULL
+};
+
+static const struct attribute_group q8_hardwaremgr_attr_group = {
+	.attrs = q8_hardwaremgr_attrs,
+};
+
+static int __q8_detect q8_hardwaremgr_probe(struct platform_device *pdev)
 {
 	struct q8_hardwaremgr_data *data;
-	int ret = 0;
+	int attrs_ret, ret = 0;
 
-	data = kzalloc(sizeof(*data), GFP_KERNEL);
-	if (!data)
-		return -ENOMEM;
+	q8_hardwaremgr_set_probe_failed(false);
+
+	data = devm_kzalloc(&pdev->dev, sizeof(*data), GFP_KERNEL);
+	if (!data) {
+		ret = -ENOMEM;
+		goto error;
+	}
 
 	data->dev = &pdev->dev;
 	data->soc = (long)pdev->dev.platform_data;
+	mutex_init(&data->lock);
+	mutex_init(&data->of_node_lock);
+	mutex_init(&data->fw_lock);
+	INIT_WORK(&data->fw_work, q8_hardwaremgr_fw_work);
+	spin_lock_init(&data->timing_lock);
+#ifndef Q8_HWMGR_ONESHOT
+	INIT_WORK(&data->touchscreen_work, q8_hardwaremgr_touchscreen_work);
+	INIT_DELAYED_WORK(&data->accelerometer_work,
+			  q8_hardwaremgr_accelerometer_work);
+#endif
+	platform_set_drvdata(pdev, data);
+
+	q8_hardwaremgr_timing_start(data, q8_hardwaremgr_init_ns);
+	q8_hardwaremgr_capture_start();
+	q8_hardwaremgr_stats_reset();
+	q8_hardwaremgr_mark(data, timing_probe);
 
 	ret = q8_hardwaremgr_fixup_touchscreen_node(data);
 	if (ret)
@@ -1052,73 +4744,196 @@ static int q8_hardwaremgr_probe(struct platform_device *pdev)
 	if (ret)
 		goto error;
 
-	ret = q8_hardwaremgr_do_probe(data, &data->touchscreen, "touchscreen",
-				      q8_hardwaremgr_probe_touchscreen);
+	ret = q8_hardwaremgr_watch(data);
 	if (ret)
 		goto error;
 
-	ret = q8_hardwaremgr_do_probe(data, &data->accelerometer,
-				      "accelerometer",
-				      q8_hardwaremgr_probe_accelerometer);
+	q8_hardwaremgr_load_hits(data->dev);
+
+	/* Before detecting, userspace may look at them on the uevent */
+	attrs_ret = sysfs_create_group(&pdev->dev.kobj,
+				       &q8_hardwaremgr_attr_group);
+	if (attrs_ret)
+		dev_warn(data->dev, "Error creating sysfs attributes %d\n",
+			 attrs_ret);
+
+	mutex_lock(&data->lock);
+	ret = q8_hardwaremgr_initial_detect(data);
 	if (ret)
+		q8_hardwaremgr_reset(data); /* Drops e.g. discovered bus refs */
+	mutex_unlock(&data->lock);
+	if (ret) {
+		if (!attrs_ret)
+			sysfs_remove_group(&pdev->dev.kobj,
+					   &q8_hardwaremgr_attr_group);
+		q8_hardwaremgr_unwatch(data);
 		goto error;
+	}
 
-	if (data->has_rda599x)
-		dev_info(data->dev, "Found a rda599x sdio/i2c wifi/bt/fm combo chip\n");
+	mutex_lock(&q8_hardwaremgr_active_lock);
+	q8_hardwaremgr_active = data;
+	mutex_unlock(&q8_hardwaremgr_active_lock);
 
-	q8_hardwaremgr_apply_touchscreen(data);
-	q8_hardwaremgr_apply_accelerometer(data);
-	q8_hardwaremgr_apply_quirks(data);
+	return 0;
 
 error:
-	kfree(data);
-
+	/* Unless we get probed again, get_profile() must not keep deferring */
+	if (ret != -EPROBE_DEFER)
+		q8_hardwaremgr_set_probe_failed(true);
 	return ret;
 }
 
 static int q8_hardwaremgr_remove(struct platform_device *pdev)
 {
-	/* Nothing todo */
+	struct q8_hardwaremgr_data *data = platform_get_drvdata(pdev);
+
+	mutex_lock(&q8_hardwaremgr_active_lock);
+	q8_hardwaremgr_active = NULL;
+	mutex_unlock(&q8_hardwaremgr_active_lock);
+#ifndef Q8_HWMGR_ONESHOT
+	cancel_work_sync(&data->touchscreen_work);
+	cancel_delayed_work_sync(&data->accelerometer_work);
+#endif
+
+	sysfs_remove_group(&pdev->dev.kobj, &q8_hardwaremgr_attr_group);
+
+	mutex_lock(&data->lock);
+	q8_hardwaremgr_revert(data);
+	q8_hardwaremgr_reset(data);
+	mutex_unlock(&data->lock);
+
+	q8_hardwaremgr_unwatch(data);
+
+	/* Nothing publishes a profile anymore, unless we get probed again */
+	q8_hardwaremgr_set_probe_failed(true);
+
 	return 0;
 }
 
 static struct platform_driver q8_hardwaremgr_driver = {
 	.driver = {
 		.name	= "q8-hwmgr",
+#ifndef Q8_HWMGR_ONESHOT
+		/*
+		 * Probing waits for the i2c busses and sleeps for the
+		 * touchscreen power-on delay, don't hold up other drivers.
+		 */
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+#endif
 	},
+#ifndef Q8_HWMGR_ONESHOT
 	.probe	= q8_hardwaremgr_probe,
+#endif
 	.remove = q8_hardwaremgr_remove,
 };
 
+/*
+ * We match on the machine compatible. The table is not exported through
+ * MODULE_DEVICE_TABLE(), no device carries the root node's modalias, so
+ * the aliases would never match anything, see 60-q8-hardwaremgr.rules for
+ * how the module gets loaded.
+ */
+static const struct of_device_id q8_hardwaremgr_of_match[] = {
+#if Q8_HWMGR_BUILD_A13
+	{ .compatible = "allwinner,q8-a13", .data = (void *)a13 },
+#endif
+#if Q8_HWMGR_BUILD_A23
+	{ .compatible = "allwinner,q8-a23", .data = (void *)a23 },
+#endif
+#if Q8_HWMGR_BUILD_A33
+	{ .compatible = "allwinner,q8-a33", .data = (void *)a33 },
+#endif
+	{ }
+};
+
 static int __init q8_hardwaremgr_init(void)
 {
+	const struct of_device_id *match;
 	struct platform_device *pdev;
+	struct device_node *np;
 	enum soc soc;
 	int ret;
 
-	if (of_machine_is_compatible("allwinner,q8-a13"))
-		soc = a13;
-	else if (of_machine_is_compatible("allwinner,q8-a23"))
-		soc = a23;
-	else if (of_machine_is_compatible("allwinner,q8-a33"))
-		soc = a33;
-	else
+	q8_hardwaremgr_init_ns = ktime_get_ns();
+	q8_hardwaremgr_index_ts_rules();
+
+	/* Also created on other machines, for replaying capture logs */
+	q8_hardwaremgr_debugfs = debugfs_create_dir("q8-hwmgr", NULL);
+	debugfs_create_blob("capture", 0400, q8_hardwaremgr_debugfs,
+			    &q8_hardwaremgr_capture_blob);
+	debugfs_create_file("occupancy", 0400, q8_hardwaremgr_debugfs, NULL,
+			    &q8_hardwaremgr_occupancy_fops);
+#ifndef Q8_HWMGR_ONESHOT
+	debugfs_create_file("replay", 0600, q8_hardwaremgr_debugfs, NULL,
+			    &q8_hardwaremgr_replay_fops);
+	debugfs_create_file("fuzz", 0600, q8_hardwaremgr_debugfs, NULL,
+			    &q8_hardwaremgr_fuzz_fops);
+#endif
+
+	np = of_find_node_by_path("/");
+	match = of_match_node(q8_hardwaremgr_of_match, np);
+	of_node_put(np);
+	if (!match)
 		return 0;
 
+	soc = (long)match->data;
+
 	pdev = platform_device_alloc("q8-hwmgr", 0);
-	if (!pdev)
-		return -ENOMEM;
+	if (!pdev) {
+		ret = -ENOMEM;
+		goto remove_debugfs;
+	}
 
 	pdev->dev.platform_data = (void *)(long)soc;
 
 	ret = platform_device_add(pdev);
-	if (ret)
-		return ret;
+	if (ret) {
+		platform_device_put(pdev);
+		goto remove_debugfs;
+	}
+
+	/* Set before registering the driver, probing may be asynchronous */
+	q8_hardwaremgr_pdev = pdev;
+
+#ifdef Q8_HWMGR_ONESHOT
+	/* Probe synchronously, before our init sections get freed */
+	ret = platform_driver_probe(&q8_hardwaremgr_driver,
+				    q8_hardwaremgr_probe);
+#else
+	ret = platform_driver_register(&q8_hardwaremgr_driver);
+#endif
+	if (ret) {
+		q8_hardwaremgr_pdev = NULL;
+		platform_device_unregister(pdev);
+		goto remove_debugfs;
+	}
+
+	return 0;
 
-	return platform_driver_register(&q8_hardwaremgr_driver);
+remove_debugfs:
+	debugfs_remove_recursive(q8_hardwaremgr_debugfs);
+	kfree(q8_hardwaremgr_capture_log.buf);
+	return ret;
+}
+
+static void __exit q8_hardwaremgr_exit(void)
+{
+	if (q8_hardwaremgr_pdev) {
+		platform_driver_unregister(&q8_hardwaremgr_driver);
+		platform_device_unregister(q8_hardwaremgr_pdev);
+	}
+
+	debugfs_remove_recursive(q8_hardwaremgr_debugfs);
+	kfree(q8_hardwaremgr_capture_log.buf);
 }
 
+/*
+ * As a module every initcall level is module_init(), when it loads is up to
+ * the udev rule. Built in, an earlier level would run before the i2c
+ * adapter drivers have registered, which a oneshot probe can not defer on.
+ */
 device_initcall(q8_hardwaremgr_init);
+module_exit(q8_hardwaremgr_exit);
 
 MODULE_DESCRIPTION("Allwinner q8 formfactor tablet hardware manager");
 MODULE_AUTHOR("Hans de Goede <hdegoede@redhat.com>");
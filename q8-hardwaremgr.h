@@ -0,0 +1,102 @@
+/*
+ * Allwinner q8 formfactor tablet hardware manager, in kernel API
+ *
+ * Copyright (C) 2016 Hans de Goede <hdegoede@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __Q8_HARDWAREMGR_H__
+#define __Q8_HARDWAREMGR_H__
+
+#include <linux/bitops.h>
+#include <linux/types.h>
+
+enum q8_hwmgr_soc {
+	Q8_HWMGR_SOC_A13,
+	Q8_HWMGR_SOC_A23,
+	Q8_HWMGR_SOC_A33,
+};
+
+/* The esp8089 sdio wifi needs crystal_26M_en=1 */
+#define Q8_HWMGR_QUIRK_ESP_CRYSTAL_26M	BIT(0)
+
+#define Q8_HWMGR_FW_NAME_LEN		64
+
+/**
+ * struct q8_hwmgr_device_info - Detection result for a single device
+ * @compatible:		Compatible of the detected chip, NULL if none was found
+ * @model:		Chip model name, e.g. "gsl1680-b482" or "da280"
+ * @addr:		I2C address of the chip
+ * @confidence:		Identification confidence 0-100
+ * @needs_regulator:	Chip only responded with its vddio-supply enabled
+ * @power_on_delay_ms:	Delay after power-on after which the chip responded
+ * @rejected_model:	Best match not applied because of a too low
+ *			confidence, NULL if none
+ * @rejected_addr:	I2C address of the rejected match
+ * @rejected_confidence: Identification confidence of the rejected match
+ */
+struct q8_hwmgr_device_info {
+	const char *compatible;
+	const char *model;
+	u16 addr;
+	unsigned int confidence;
+	bool needs_regulator;
+	unsigned int power_on_delay_ms;
+	const char *rejected_model;
+	u16 rejected_addr;
+	unsigned int rejected_confidence;
+};
+
+/**
+ * struct q8_hwmgr_profile - Detected hardware profile of a q8 tablet
+ * @soc:		One of enum q8_hwmgr_soc
+ * @touchscreen:	Touchscreen detection result
+ * @accelerometer:	Accelerometer detection result
+ * @touchscreen_variant: Selected touchscreen variant
+ * @touchscreen_width:	Touchscreen width, 0 if not set
+ * @touchscreen_height:	Touchscreen height, 0 if not set
+ * @touchscreen_invert_x: Touchscreen x axis is inverted
+ * @touchscreen_invert_y: Touchscreen y axis is inverted
+ * @touchscreen_swap_x_y: Touchscreen x and y axis are swapped
+ * @touchscreen_fw_name: Touchscreen firmware filename, empty if not set
+ * @has_rda599x:	A rda599x wifi/bt/fm combo chip was found
+ * @quirks:		Q8_HWMGR_QUIRK_* flags
+ */
+struct q8_hwmgr_profile {
+	int soc;
+	struct q8_hwmgr_device_info touchscreen;
+	struct q8_hwmgr_device_info accelerometer;
+	int touchscreen_variant;
+	int touchscreen_width;
+	int touchscreen_height;
+	bool touchscreen_invert_x;
+	bool touchscreen_invert_y;
+	bool touchscreen_swap_x_y;
+	char touchscreen_fw_name[Q8_HWMGR_FW_NAME_LEN];
+	bool has_rda599x;
+	unsigned int quirks;
+};
+
+/**
+ * q8_hwmgr_get_profile - Get the detected hardware profile
+ * @profile:	Filled with the profile on success
+ *
+ * The profile is published before the devicetree changes are applied, so
+ * drivers probing because of those changes always see it.
+ *
+ * Return: 0 on success, -ENODEV if this is not a q8 tablet, detection
+ * failed or the hardware manager has been removed, -EPROBE_DEFER if
+ * detection has not completed (yet).
+ */
+int q8_hwmgr_get_profile(struct q8_hwmgr_profile *profile);
+
+#endif /* ifndef __Q8_HARDWAREMGR_H__ */